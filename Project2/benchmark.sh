@@ -0,0 +1,126 @@
+#!/bin/bash
+#Benchmark for myshell's hot paths, drives the shell with script files (no prompt)
+#and prints one JSON object so runs can be compared with each other.
+#Usage: ./benchmark.sh [myshell binary] [scale]
+#Build first: gcc -O2 -o myshell mainSetup.c
+#scale multiplies every command count, default 1
+
+shell="${1:-./myshell}"
+scale="${2:-1}"
+
+if [ ! -x "$shell" ]; then
+    echo "Cannot run $shell, build it with: gcc -O2 -o myshell mainSetup.c" >&2
+    exit 1
+fi
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+#Keep the benchmark away from the user's history file, but go through a file
+#like an interactive shell does instead of the in-memory history of scripts
+export MYSHELL_HISTFILE="$work_dir/history"
+export MYSHELL_HISTFORCE=1
+unset MYSHELL_STATS
+
+launch_count=$(( 2000 * scale ))
+line_count=$(( 20000 * scale ))
+history_size=$(( 100000 * scale ))
+history_runs=$(( 5000 * scale ))
+job_count=$(( 500 * scale ))
+glob_files=$(( 100000 * scale ))
+glob_runs=$(( 200 * scale ))
+subst_count=$(( 1000 * scale ))
+
+#Run a script file through the shell 3 times, print the best elapsed nanoseconds.
+#Every run starts from an empty history file.
+run_script() {
+    local script="$1"
+    local start end best=0
+    for run in 1 2 3; do
+        rm -f "$MYSHELL_HISTFILE"
+        start=$(date +%s%N)
+        "$shell" "$script" > /dev/null 2>&1
+        end=$(date +%s%N)
+        if [ "$best" -eq 0 ] || [ $(( end - start )) -lt "$best" ]; then
+            best=$(( end - start ))
+        fi
+    done
+    echo "$best"
+}
+
+#Print the same line n times
+repeat_line() {
+    yes "$1" | head -n "$2"
+}
+
+#a / b with 3 decimals
+divide() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", (b > 0 ? a / b : 0) }'
+}
+
+#Launch: external /bin/true with posix_spawn and with fork
+repeat_line "/bin/true" "$launch_count" > "$work_dir/true.sh"
+spawn_ns=$(run_script "$work_dir/true.sh")
+{ echo "launch fork"; cat "$work_dir/true.sh"; } > "$work_dir/true_fork.sh"
+fork_ns=$(run_script "$work_dir/true_fork.sh")
+
+#Parse: short builtin lines against 4 KiB lines with 512 arguments,
+#both include reading the line and adding it to the history
+long_line="true$(printf ' arg%04d' $(seq 1 512))"
+repeat_line "true" "$line_count" > "$work_dir/short.sh"
+repeat_line "$long_line" "$line_count" > "$work_dir/long.sh"
+short_ns=$(run_script "$work_dir/short.sh")
+long_ns=$(run_script "$work_dir/long.sh")
+
+#Tokenizer throughput: 4 KiB lines where every argument is quoted or escaped
+quoted_line="true$(printf ' "a %03d" '"'"'b|%03d'"'"' c\\ %03d' $(seq 1 160 | awk '{ print $1, $1, $1 }'))"
+repeat_line "$quoted_line" "$line_count" > "$work_dir/quoted.sh"
+quoted_ns=$(run_script "$work_dir/quoted.sh")
+quoted_bytes=$(( (${#quoted_line} + 1) * line_count ))
+
+#History: fill it, then list and search it repeatedly
+awk -v n="$history_size" 'BEGIN { for (i = 0; i < n; i++) printf "true entry %d %s\n", i, (i % 7 ? "build" : "deploy") }' > "$work_dir/fill.sh"
+fill_ns=$(run_script "$work_dir/fill.sh")
+{ cat "$work_dir/fill.sh"; repeat_line "history" "$history_runs"; } > "$work_dir/print.sh"
+print_ns=$(( $(run_script "$work_dir/print.sh") - fill_ns ))
+{ cat "$work_dir/fill.sh"; repeat_line "history -g entry 4242" "$history_runs"; } > "$work_dir/search.sh"
+search_ns=$(( $(run_script "$work_dir/search.sh") - fill_ns ))
+
+#Glob: one big directory, expanded once (readdir) and then from the listing cache
+mkdir "$work_dir/logs"
+(cd "$work_dir/logs" && seq -f "f%07g.log" 1 "$glob_files" | xargs touch)
+sleep 2 #a listing read in the second its directory changed is not cached
+echo "cd $work_dir/logs" > "$work_dir/glob1.sh"
+echo "true *.log" >> "$work_dir/glob1.sh"
+{ echo "cd $work_dir/logs"; repeat_line "true *.log" "$glob_runs"; } > "$work_dir/glob.sh"
+glob_first_ns=$(run_script "$work_dir/glob1.sh")
+glob_ns=$(( $(run_script "$work_dir/glob.sh") - glob_first_ns ))
+
+#Command substitution: two on one line, a builtin and an external command
+repeat_line 'true $(echo a b) $(/bin/true)' "$subst_count" > "$work_dir/subst.sh"
+subst_ns=$(run_script "$work_dir/subst.sh")
+
+#Background jobs: start them all, then wait for every one to be reaped
+{ repeat_line "/bin/true &" "$job_count"; echo "wait"; } > "$work_dir/jobs.sh"
+jobs_ns=$(run_script "$work_dir/jobs.sh")
+
+cat <<EOF
+{
+  "binary": "$shell",
+  "scale": $scale,
+  "launch_true_spawn_per_sec": $(divide "$(( launch_count * 1000000000 ))" "$spawn_ns"),
+  "launch_true_fork_per_sec": $(divide "$(( launch_count * 1000000000 ))" "$fork_ns"),
+  "short_line_us": $(divide "$(( short_ns / 1000 ))" "$line_count"),
+  "long_line_4k_us": $(divide "$(( long_ns / 1000 ))" "$line_count"),
+  "quoted_line_mb_per_sec": $(divide "$(( quoted_bytes * 1000 ))" "$quoted_ns"),
+  "history_entries": $history_size,
+  "history_append_us": $(divide "$(( fill_ns / 1000 ))" "$history_size"),
+  "history_print_us": $(divide "$(( print_ns / 1000 ))" "$history_runs"),
+  "history_search_us": $(divide "$(( search_ns / 1000 ))" "$history_runs"),
+  "glob_files": $glob_files,
+  "glob_first_ms": $(divide "$(( glob_first_ns / 1000 ))" 1000),
+  "glob_cached_us": $(divide "$(( glob_ns / 1000 ))" "$(( glob_runs - 1 ))"),
+  "substitution_line_us": $(divide "$(( subst_ns / 1000 ))" "$subst_count"),
+  "background_jobs_per_sec": $(divide "$(( job_count * 1000000000 ))" "$jobs_ns")
+}
+EOF
@@ -0,0 +1,131 @@
+/* Fuzz harness for myshell's tokenizer. Arbitrary bytes go through
+tokenizeLine() the way setup() hands it a line, and the result is checked
+against what the rest of the shell relies on.
+
+libFuzzer:  clang -g -O1 -fsanitize=fuzzer,address -DLIBFUZZER -o fuzz_tokenize fuzz_tokenize.c
+            ./fuzz_tokenize -close_fd_mask=2 corpus/
+AFL:        afl-clang-fast -g -O1 -o fuzz_tokenize fuzz_tokenize.c
+            afl-fuzz -i corpus -o findings ./fuzz_tokenize
+Plain:      gcc -g -fsanitize=address,undefined -o fuzz_tokenize fuzz_tokenize.c
+            ./fuzz_tokenize < line    (or a list of files to replay)
+
+Syntax errors are reported on stderr like in the shell, -close_fd_mask=2
+keeps libFuzzer quiet about them. */
+
+#define main myshellMain
+#include "mainSetup.c"
+#undef main
+
+char *operatorTokens[] = {
+    pipeToken, orToken, andToken, semicolonToken, backgroundToken,
+    inputToken, outputToken, appendToken, errorToken, errorAppendToken,
+    errorToOutputToken, outputToErrorToken,
+};
+
+// Argument is one of the tokens above, not a word of the line
+int isOperatorToken(char *arg) {
+
+    for (size_t i = 0; i < sizeof(operatorTokens) / sizeof(operatorTokens[0]); i++) {
+        if (arg == operatorTokens[i]) return 1;
+    }
+    return 0;
+
+}
+
+// What expandArgs() and runSubstitutions() expect of a word marked with
+// substToken: every SUBST_START or SUBST_QUOTED is closed by a SUBST_END
+// before the next one opens, and no SUBST_END stands on its own.
+void checkSubstitutionWord(const char *word) {
+
+    int open = 0;
+    int count = 0;
+    for (const char *c = word; *c != '\0'; c++) {
+        if (*c == SUBST_START || *c == SUBST_QUOTED) {
+            if (open) abort();
+            open = 1;
+            count++;
+        } else if (*c == SUBST_END) {
+            if (!open) abort();
+            open = 0;
+        }
+    }
+    if (open || count == 0) abort();
+
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+    static char **args = NULL;
+    static size_t capacity = 0;
+
+    // setup() passes the line with a '\0' after it, tokenizeLine() may write there
+    char *line = malloc(size + 1);
+    if (line == NULL) return 0;
+    memcpy(line, data, size);
+    line[size] = '\0';
+    char *end = line + size;
+
+    long ct = tokenizeLine(line, size, &args, &capacity);
+    if (ct < 0) {
+        if (args[0] != NULL) abort();
+        free(line);
+        return 0;
+    }
+    if ((size_t)ct + 1 > capacity || args[ct] != NULL) abort();
+
+    char *previousEnd = line; // words are written in order and never overlap
+    for (long i = 0; i < ct; i++) {
+        char *arg = args[i];
+        if (arg == NULL) abort();
+        if (isOperatorToken(arg)) continue;
+        if (arg == globToken || arg == substToken) {
+            // a marker is always followed by the word it is about
+            if (i + 1 >= ct || args[i + 1] == globToken || args[i + 1] == substToken
+                    || isOperatorToken(args[i + 1])) abort();
+            continue;
+        }
+        if (arg < previousEnd || arg > end) abort();
+        char *terminator = memchr(arg, '\0', end + 1 - arg);
+        if (terminator == NULL) abort();
+        if (i > 0 && args[i - 1] == substToken) checkSubstitutionWord(arg);
+        previousEnd = terminator + 1;
+    }
+
+    free(line);
+    return 0;
+
+}
+
+#ifndef LIBFUZZER
+// Run one input from stdin (AFL), or every file named on the command line
+int main(int argc, char *argv[]) {
+
+    for (int i = argc > 1 ? 1 : 0; i < argc; i++) {
+        int fd = i == 0 ? STDIN_FILENO : open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            perror(argv[i]);
+            return 1;
+        }
+        char *data = NULL;
+        size_t size = 0, capacity = 0;
+        ssize_t n;
+        do {
+            if (size == capacity) {
+                capacity = capacity == 0 ? 4096 : capacity * 2;
+                data = realloc(data, capacity);
+                if (data == NULL) {
+                    perror("fuzz_tokenize");
+                    return 1;
+                }
+            }
+            n = read(fd, data + size, capacity - size);
+            if (n > 0) size += n;
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        if (fd != STDIN_FILENO) close(fd);
+        LLVMFuzzerTestOneInput((const uint8_t *)data, size);
+        free(data);
+    }
+    return 0;
+
+}
+#endif
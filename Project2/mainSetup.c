@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* splice, tee, copy_file_range, pipe2, F_SETPIPE_SZ */
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -8,358 +9,4302 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <time.h>
+#include <spawn.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
-#define MAX_LINE 80 /* 80 chars per line, per command */
-#define HISTORY_SIZE 10
+#define READ_BLOCK_SIZE 65536 /* input is read in blocks of this size */
+#define HISTORY_SIZE 10 /* entries shown by history */
+#define HISTORY_CAPACITY 100000 /* entries kept in the history file, MYSHELL_HISTSIZE overrides */
+#define HISTORY_MAGIC "MYSHIST1"
+#define HISTORY_MAP_MIN (16 * 1024 * 1024) /* address space reserved for the history mapping */
+#define COMMAND_CACHE_SIZE 128 /* buckets in the PATH lookup table */
+#define PATH_RECHECK_INTERVAL 1 /* seconds between PATH directory mtime checks */
+#define LAUNCH_SPAWN 0 /* posix_spawn, no page table copy of the shell */
+#define LAUNCH_FORK 1  /* classic fork() + execv() */
+#define PIPE_BUFFER_SIZE (1024 * 1024) /* pipe capacity in splice mode and splice() chunk size */
+#define COPY_BUFFER_SIZE 65536 /* read/write fallback chunk size */
+#define KERNEL_COPY_SIZE (1024 * 1024 * 1024) /* copy_file_range/sendfile chunk size */
+#define COPY_FILE_RANGE 0 /* copyFd() methods, tried in this order */
+#define COPY_SENDFILE 1
+#define COPY_SPLICE 2
+#define COPY_READ_WRITE 3
+#define PID_TABLE_MIN_SIZE 64 /* starting buckets of the pid -> job table */
+#define PLACEHOLDER "{}" /* replaced by the input in parallel's command */
+#define PROCESS_TABLE_SIZE 256 /* buckets of the pid -> start time table */
+#define DIR_CACHE_SIZE 256 /* buckets of the directory listing cache */
+#define DIR_CACHE_MAX_LISTINGS 4096 /* the cache starts over beyond this */
+#define ARENA_BLOCK_SIZE 65536 /* expanded arguments are allocated in blocks of this size */
+#define ENTRY_OTHER 0 /* DirEntry types */
+#define ENTRY_DIR 1
+#define ENTRY_LINK_TO_DIR 2 /* followed by patterns, not by ** */
+#define MAX_LIMITS 8 /* resource limits one limit prefix can set */
+#define IOPRIO_CLASS_SHIFT 13 /* ioprio_set() values, not in the libc headers */
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define SUBST_START '\001'  /* $(...) or `...` outside quotes, its output is split into words */
+#define SUBST_QUOTED '\002' /* the same inside "...", its output stays one word */
+#define SUBST_END '\003'    /* after the command of either */
+#define CAPTURE_BUFFER_SIZE 4096 /* first size of a substitution's output buffer */
 
-char history[HISTORY_SIZE][MAX_LINE];
-int history_count = 0;
+/* buffered input; lines of any length, several lines per read() */
+typedef struct LineReader {
+    int fd;          /* -1 when the whole input is already in buffer (-c) */
+    char *buffer;
+    size_t capacity;
+    size_t start;    /* first byte not handed out yet */
+    size_t end;      /* one past the last byte read */
+    int eof;
+} LineReader;
+
+/* start of the history file; records follow as [u32 length][text][u32 length]
+so the newest entries can be walked backwards from dataEnd */
+typedef struct HistoryHeader {
+    char magic[8];
+    uint64_t entryCount;
+    uint64_t dataEnd;    /* bytes in use, header included */
+    uint64_t generation; /* bumped when old entries are compacted away */
+} HistoryHeader;
+
+/* ascending entry numbers for one key of the search index */
+typedef struct PostingList {
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t capacity;
+} PostingList;
+
+/* trigram -> entries containing it, open addressing */
+typedef struct TrigramSlot {
+    uint32_t key; /* trigram | 1 << 24, 0 for a free slot */
+    PostingList list;
+} TrigramSlot;
+
+/* one process of a background job */
+typedef struct JobProcess {
+    pid_t pid;
+    int done;
+} JobProcess;
+
+/* a background command or pipeline, %id in fg/kill/wait */
+typedef struct Job {
+    int id;
+    pid_t pgid;          /* process group, the first stage */
+    JobProcess *processes;
+    int processCount;
+    int running;         /* processes not reaped yet */
+    int status;          /* wait status of the last stage */
+    char *command;
+} Job;
+
+/* pid -> job, so a reaped child finds its job in O(1) */
+typedef struct PidEntry {
+    pid_t pid;
+    Job *job;
+    struct PidEntry *next;
+} PidEntry;
+
+/* one running command of the parallel builtin */
+typedef struct ParallelTask {
+    pid_t pid;        /* 0 for a free slot */
+    int input;        /* index of its input */
+    int outFd;        /* stdout and stderr, kept until the task ends */
+    int errFd;
+    struct timespec start;
+} ParallelTask;
+
+/* a child we started: what to charge its resource usage to */
+typedef struct TrackedProcess {
+    pid_t pid;
+    char *name;      /* basename of the command */
+    struct timespec start;
+    struct TrackedProcess *next;
+} TrackedProcess;
+
+/* resource usage of every run of one command name */
+typedef struct CommandStats {
+    char *name;
+    double *wallTimes; /* seconds, one per run */
+    int runs;
+    int capacity;
+    double userTime;
+    double systemTime;
+    long maxRss;       /* KB, largest of all runs */
+    long voluntarySwitches;
+    long involuntarySwitches;
+    struct CommandStats *next;
+} CommandStats;
+
+/* a command the shell runs itself, without exec */
+typedef struct Builtin {
+    const char *name;
+    int (*function)(char *args[]); /* returns the exit status */
+    int forks; /* 1: runs in a child like an external command */
+    const char *options; /* letters of the options it takes as first argument,
+                            NULL: all. Others go to the command it shadows */
+} Builtin;
+
+/* one name in a cached directory listing */
+typedef struct DirEntry {
+    const char *name;
+    unsigned short length;
+    unsigned char type; /* ENTRY_OTHER, ENTRY_DIR or ENTRY_LINK_TO_DIR */
+} DirEntry;
+
+/* a directory read for glob expansion, valid while its mtime stays the same */
+typedef struct DirListing {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    int racy;             /* read in the second it changed, not trusted */
+    unsigned int generation; /* last expansion that checked it */
+    DirEntry *entries;    /* sorted by name */
+    int count;
+    char *names;          /* every name, '\0' separated */
+    struct DirListing *next;
+} DirListing;
+
+/* block of the argument arena */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+/* growing argument list allocated from the arena */
+typedef struct ArgList {
+    char **items;
+    int count;
+    int capacity;
+} ArgList;
+
+/* a command substitution being run, its output collected in a growing buffer */
+typedef struct Substitution {
+    pid_t pid;
+    int fd;           /* read end of the output pipe, -1 after EOF */
+    char *output;
+    size_t length;
+    size_t capacity;
+} Substitution;
+
+/* what pin, nice, ionice and limit ask for, applied in the child before exec */
+typedef struct LaunchSettings {
+    int pinned;
+    cpu_set_t cpus;
+    int niceSet;
+    int niceIncrement;
+    int ioPriority;   /* -1: unchanged */
+    int limitCount;
+    int limitResources[MAX_LIMITS];
+    rlim_t limitValues[MAX_LIMITS];
+} LaunchSettings;
+
+/* name=value resource of the limit prefix */
+typedef struct LimitName {
+    const char *name;
+    int resource;
+} LimitName;
+
+/* one resolved command in the PATH lookup table (like bash's hash) */
+typedef struct CommandCacheEntry {
+    char *name;
+    char *path;
+    int hits;
+    struct CommandCacheEntry *next;
+} CommandCacheEntry;
+
+int historyFd = -1;       /* -1: history is only kept in memory */
+char *historyData = NULL; /* file mapping or malloc'd buffer, starts with the header */
+size_t historyMapped = 0; /* bytes of historyData that may be used */
+uint64_t historyCapacity = HISTORY_CAPACITY;
+
+/* search index, built on the first search and extended as entries arrive */
+uint64_t *historyOffsets = NULL; /* entry number -> record offset */
+uint64_t historyIndexedCount = 0;
+uint64_t historyOffsetsCapacity = 0;
+uint64_t historyIndexedEnd = 0;
+uint64_t historyIndexedGeneration = 0;
+PostingList *prefixIndex = NULL; /* by the first two bytes of an entry */
+TrigramSlot *trigramTable = NULL;
+uint32_t trigramTableSize = 0;
+uint32_t trigramCount = 0;
 char commandPath[512];
 pid_t foreground_pid = 0;
-pid_t background_pids[HISTORY_SIZE];
-int background_count = 0;
-int isFromHistory = 0;
+int interactive = 1; /* 0 for -c and script files: no prompt */
+LineReader inputReader = { STDIN_FILENO, NULL, 0, 0, 0, 0 };
+char *lastLine = NULL; /* the line setup() read, as typed, for the history */
+size_t lastLineCapacity = 0;
+int historyDepth = 0; /* history -i running a line that holds history -i */
+
+Job **jobs = NULL; /* indexed by job id, NULL for unused ids */
+int jobsCapacity = 0;
+int maxJobId = 0;  /* highest id in use, new jobs get the next one */
+int jobCount = 0;
+PidEntry **pidTable = NULL;
+int pidTableSize = 0;
+int pidTableCount = 0;
+int signalFd = -1;  /* SIGCHLD arrives here instead of a handler */
+sigset_t originalSignalMask; /* what children get back before exec */
+
+CommandCacheEntry *commandCache[COMMAND_CACHE_SIZE];
+char *cachedPathEnv = NULL; /* PATH value the cache was built for */
+char *pathDirsBuffer = NULL; /* private copy of PATH split in place */
+char **pathDirs = NULL;
+struct timespec *pathDirMtimes = NULL;
+int pathDirCount = 0;
+time_t lastPathCheck = 0;
+int launchMode = LAUNCH_SPAWN;
+int splicePipes = 0; /* 1: pipelines get PIPE_BUFFER_SIZE pipes */
+int lastStatus = 0;  /* exit status of the last command, 128 + n for signal n */
+LaunchSettings *launchSettings = NULL; /* for the processes being started, NULL: none */
+LaunchSettings foregroundDefaults; /* pin -f */
+LaunchSettings backgroundDefaults; /* pin -b */
+int giveTerminal = 0;   /* 1 while starting a foreground job */
+int terminalFd = -1;    /* the controlling terminal when we do job control */
+pid_t shellPgid = 0;
+LimitName limitNames[] = {
+    { "mem", RLIMIT_AS },
+    { "cpu", RLIMIT_CPU },
+    { "nofile", RLIMIT_NOFILE },
+    { "procs", RLIMIT_NPROC },
+    { "fsize", RLIMIT_FSIZE },
+    { "stack", RLIMIT_STACK },
+    { "core", RLIMIT_CORE },
+};
+
+TrackedProcess *trackedProcesses[PROCESS_TABLE_SIZE];
+CommandStats *commandStats[COMMAND_CACHE_SIZE];
+int timing = 0;           /* 1 while the time builtin collects usage */
+struct rusage timedUsage; /* children reaped while timing */
+pid_t statsPid = 0;       /* the shell that registered dumpStatsOnExit */
+
+/* Operators get these arguments instead of pointers into the line, so they
+are compared by address and a quoted "|" or ">" stays an ordinary word. */
+char pipeToken[] = "|";
+char orToken[] = "||";
+char andToken[] = "&&";
+char semicolonToken[] = ";";
+char backgroundToken[] = "&";
+char inputToken[] = "<";
+char outputToken[] = ">";
+char appendToken[] = ">>";
+char errorToken[] = "2>";
+char errorAppendToken[] = "2>>";
+char errorToOutputToken[] = "2>&1";
+char outputToErrorToken[] = ">&2";
+char globToken[] = "*"; /* the next argument is a pattern to expand */
+char substToken[] = "$("; /* the next argument holds command substitutions */
 
-void setup(char inputBuffer[], char *args[], int *background);
-void addToHistory(char *args[]);
+DirListing *dirCache[DIR_CACHE_SIZE];
+int dirCacheCount = 0;
+DirListing *retiredListings = NULL; /* replaced listings, freed by the next expansion */
+unsigned int globGeneration = 0;
+ArenaBlock *globArena = NULL;
+
+extern char **environ;
+
+char *readLine(LineReader *reader, size_t *length);
+void setup(char **inputBuffer, char ***args, int *background);
+char *operatorToken(char **cursor);
+long tokenizeLine(char *line, size_t length, char ***args, size_t *capacity);
+char *substitutionEnd(char *c, char *end);
+char *copySubstitution(char *r, char *end, char **w, char marker);
+int isListOperator(const char *arg);
+void runCommandList(char *args[], int background);
+int runCommand(char *args[], int background);
+int isGlobPattern(const char *word);
+void *arenaAlloc(size_t size);
+void arenaReset();
+void addArgument(ArgList *list, char *arg);
+void addGlobMatch(ArgList *matches, const char *path, size_t length);
+int compareDirEntries(const void *a, const void *b);
+int compareStrings(const void *a, const void *b);
+void freeDirListing(DirListing *listing);
+DirListing *listDirectory(const char *path);
+void reservePath(char **path, size_t *capacity, size_t length, size_t extra);
+void globEverything(char **path, size_t *capacity, size_t length, ArgList *matches);
+void globPath(char **path, size_t *capacity, size_t length, const char *rest, ArgList *matches);
+pid_t startSubstitution(char *command, pid_t pgid, int *outFd);
+int readSubstitution(Substitution *substitution);
+Substitution *runSubstitutions(char *args[], int *count);
+void addSubstitutedWord(ArgList *expanded, const char *word, Substitution substitutions[], int *next);
+char **expandArgs(char *args[]);
+void openHistory();
+void mapHistory(size_t size);
+void lockHistory(int operation);
+void unlockHistory();
+void writeHistory(const void *buffer, size_t length, uint64_t offset);
+void appendHistory(const char *command, size_t length);
+void compactHistory();
+const char *historyEntry(uint64_t index, uint32_t *length);
+void addToHistory(const char *line);
 void addToHistoryForHistoryCommand(char args[]);
 void printHistory();
-void historyCommand(int index, char inputBuffer[], char *args[], int *background);
-void moveBackgroundToForeground(int pid);
-void exitRequest();
+void postingAdd(PostingList *list, uint32_t id);
+PostingList *trigramList(uint32_t trigram, int create);
+void resetHistoryIndex();
+void syncHistoryIndex();
+void searchHistory(const char *query, int prefixOnly);
+void historyCommand(int index);
+void moveBackgroundToForeground(int number);
+char *joinArgs(char *args[]);
+Job *addJob(pid_t pids[], int count, pid_t pgid, char *command);
+void removeJob(Job *job);
+Job *findJob(int number);
+Job *findJobByPid(pid_t pid);
+void markProcessDone(pid_t pid, int status);
+void waitForJob(Job *job);
+void reapChildren();
+void waitForInput(int fd);
+void printJobNotices();
+int jobsBuiltin(char *args[]);
+int waitBuiltin(char *args[]);
+int killBuiltin(char *args[]);
+void exitRequest(char *args[]);
 void handleRedirection(char *args[]);
 void terminateRunningProcess(int signum);
 int countWords(const char *buffer);
+unsigned int hashCommandName(const char *name);
+void clearCommandCache();
+void loadPathDirs(const char *pathEnv);
+void validateCommandCache();
+CommandCacheEntry *lookupCommand(const char *name);
+char *findCommand(const char *name);
+int hashBuiltin(char *args[]);
+int addSpawnRedirections(char *args[], posix_spawn_file_actions_t *actions);
+pid_t spawnCommand(char *path, char *args[], int inFd, int outFd, int errFd, pid_t pgid);
+pid_t forkCommand(char *path, char *args[], int inFd, int outFd, int errFd, pid_t pgid);
+int launchBuiltin(char *args[]);
+void launchCommand(char *args[], int background);
+void launchJob(char *args[], int background, int forkBuiltins);
+void launchPipeline(char *args[], int background);
+void initLaunchSettings(LaunchSettings *settings, int background);
+int hasLaunchSettings(LaunchSettings *settings);
+int parseCpuList(const char *text, cpu_set_t *cpus);
+void printCpuList(cpu_set_t *cpus);
+int parseLimitValue(const char *text, rlim_t *value);
+char **parseLaunchPrefixes(char *args[], LaunchSettings *settings);
+void applyLaunchSettings(LaunchSettings *settings);
+int pinBuiltin(char *args[]);
+void setTerminalOwner(pid_t pgid);
+pid_t waitForeground(pid_t pid, int *status);
+pid_t forkBuiltin(char *args[], int inFd, int outFd, pid_t pgid, int pipeFds[], int pipeFdCount);
+int copyFd(int inFd, int outFd);
+int writeAll(int fd, const char *data, size_t length);
+int teeFd(int inFd, int outFd, int fileFds[], int fileCount);
+int catBuiltin(char *args[]);
+int copyFile(const char *from, const char *to);
+int cpBuiltin(char *args[]);
+int teeBuiltin(char *args[]);
+int pipesBuiltin(char *args[]);
+int exitCode(int status);
+int redirectionTarget(const char *operator, int *flags, int *sourceFd);
+int applyRedirections(char *args[], int savedFds[3]);
+void restoreRedirections(int savedFds[3]);
+Builtin *findBuiltin(const char *name);
+Builtin *builtinFor(char *args[]);
+void runBuiltin(Builtin *builtin, char *args[]);
+int cdBuiltin(char *args[]);
+int pwdBuiltin(char *args[]);
+int echoBuiltin(char *args[]);
+int exportBuiltin(char *args[]);
+int evaluateTest(char *args[], int count);
+int testBuiltin(char *args[]);
+int trueBuiltin(char *args[]);
+int falseBuiltin(char *args[]);
+double secondsSince(struct timespec *start);
+void trackProcess(pid_t pid, const char *command);
+pid_t waitChild(pid_t pid, int *status, int options);
+void recordCommandStats(const char *name, double wallTime, struct rusage *usage);
+double percentile(double sorted[], int count, double p);
+int compareDoubles(const void *a, const void *b);
+int compareStatsByWall(const void *a, const void *b);
+CommandStats **sortedCommandStats(int *count);
+void writeStatsJson(FILE *file);
+void dumpStatsOnExit();
+int timeBuiltin(char *args[]);
+int statsBuiltin(char *args[]);
+char **parallelCommand(char *command[], const char *input);
+pid_t startParallelTask(char *command[], const char *input, int outFd, int errFd);
+int captureFile(const char *name);
+void finishParallelTask(ParallelTask *task, int status, int exitCodes[], double times[]);
+int parallelBuiltin(char *args[]);
+void interruptForeground(int signum);
+
+
+/* Return the next line of input without its newline, NUL terminated inside
+the reader's buffer, or NULL at the end of input. The line stays valid until
+the next call. Data is read in READ_BLOCK_SIZE blocks and the buffer grows
+as needed, so neither the number of lines per read() nor the line length is
+limited. */
+
+char *readLine(LineReader *reader, size_t *length) {
+
+    size_t scanFrom = reader->start;
+
+    while (1) {
+        char *newline = memchr(reader->buffer + scanFrom, '\n', reader->end - scanFrom);
+        if (newline != NULL) {
+            char *line = reader->buffer + reader->start;
+            *newline = '\0';
+            *length = newline - line;
+            reader->start = newline + 1 - reader->buffer;
+            return line;
+        }
+
+        if (reader->eof || reader->fd < 0) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // last line without a newline; there is always room for the '\0'
+            char *line = reader->buffer + reader->start;
+            reader->buffer[reader->end] = '\0';
+            *length = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Keep the unfinished line, drop what was handed out before it
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        scanFrom = reader->end;
+
+        if (reader->capacity - reader->end < READ_BLOCK_SIZE + 1) {
+            reader->capacity = reader->capacity == 0 ? READ_BLOCK_SIZE + 1 : reader->capacity * 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+            if (reader->buffer == NULL) {
+                perror("Error reading command");
+                exit(-1);
+            }
+        }
+
+        waitForInput(reader->fd);
+        ssize_t n = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+
+        /* the signal interrupted the read system call */
+        /* if the process is in the read() system call, read returns -1
+        However, if this occurs, errno is set to EINTR. We can check this  value
+        and disregard the -1 value */
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error reading command");
+            exit(-1);  /* terminate with error code of -1 */
+        }
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        reader->end += n;
+    }
+
+}
+
+
+/* The setup function below will not return any value, but it will just: read
+in the next command line; separate it into distinct arguments, and set the
+args array entries to point to the beginning of what will become
+null-terminated, C-style strings. Both the line and the args array are owned
+by setup(), the line by the input reader and args grows with the number of
+arguments. The line as typed is kept in lastLine for the history, and a
+trailing '&' is taken off and reported through background. */
+
+void setup(char **inputBuffer, char ***args, int *background) {
+    static size_t argsCapacity = 0;
+    size_t length; /* # of characters in the command line */
+
+    /* read what the user enters on the command line */
+
+    *inputBuffer = readLine(&inputReader, &length);
+    if (*inputBuffer == NULL) {
+        /* ^d was entered, end of user command stream; a -c line or a script
+        ends with the status of its last command, like other shells */
+        exit(interactive ? 0 : lastStatus);
+    }
+
+    if (lastLineCapacity < length + 1) {
+        lastLineCapacity = length + 1 > 256 ? length + 1 : 256;
+        lastLine = realloc(lastLine, lastLineCapacity);
+        if (lastLine == NULL) {
+            perror("Error reading command");
+            exit(-1);
+        }
+    }
+    memcpy(lastLine, *inputBuffer, length + 1);
+
+    *background = 0;
+    long ct = tokenizeLine(*inputBuffer, length, args, &argsCapacity);
+    if (ct > 0 && (*args)[ct - 1] == backgroundToken) {
+        (*args)[ct - 1] = NULL;
+        *background = 1;
+    }
+} /* end of setup routine */
+
+/* Operator starting at *cursor, advanced past it, or NULL when there is none
+there. 2> is only an operator at the start of a word, the caller checks. */
+
+char *operatorToken(char **cursor) {
+
+    char *c = *cursor;
+    char *token = NULL;
+    int length = 1;
+
+    switch (c[0]) {
+        case '|':
+            if (c[1] == '|') { token = orToken; length = 2; }
+            else token = pipeToken;
+            break;
+        case '&':
+            if (c[1] == '&') { token = andToken; length = 2; }
+            else token = backgroundToken;
+            break;
+        case ';':
+            token = semicolonToken;
+            break;
+        case '<':
+            token = inputToken;
+            break;
+        case '>':
+            if (c[1] == '>') { token = appendToken; length = 2; }
+            else if (c[1] == '&' && c[2] == '2') { token = outputToErrorToken; length = 3; }
+            else token = outputToken;
+            break;
+        case '2':
+            if (c[1] != '>') break;
+            if (c[2] == '>') { token = errorAppendToken; length = 3; }
+            else if (c[2] == '&' && c[3] == '1') { token = errorToOutputToken; length = 4; }
+            else { token = errorToken; length = 2; }
+            break;
+    }
+    if (token != NULL) *cursor = c + length;
+    return token;
+
+}
+
+/* Characters that end a run of plain word characters. strcspn() checks a
+whole vector of bytes per step in glibc, so ordinary words cost no
+per-character branching. */
+#define WORD_SPECIALS " \t\r\n\"'\\|&;<>*?[$`"
+
+/* Split line into args without copying it: quotes and backslashes are taken
+out by moving the rest of the word back over them, and every word gets its
+'\0' in place. Operators, also when glued to a word (a>b, 2>&1), become the
+tokens above. A word with unquoted wildcards gets globToken in front of it
+for expandArgs(); one that also has quoted or escaped ones is taken as it is.
+A $(...) or `...` is kept between SUBST_START or SUBST_QUOTED and SUBST_END
+and its word gets substToken in front instead, the command runs when
+expandArgs() reaches it. Returns the number of arguments, or -1 with args
+empty after an unterminated quote or substitution, or when such a word also
+holds a '\0' or a marker byte of its own. A '#' at the start of a word comments out
+the rest. */
+
+long tokenizeLine(char *line, size_t length, char ***args, size_t *capacity) {
+
+    /* every argument takes at least one character of the line, a globToken
+    or substToken in front of a word at most one more, plus NULL */
+    if (*capacity < 2 * length + 2) {
+        *capacity = 2 * length + 2 > 64 ? 2 * length + 2 : 64;
+        *args = realloc(*args, *capacity * sizeof(char *));
+        if (*args == NULL) {
+            perror("Error reading command");
+            exit(-1);
+        }
+    }
+    char **argv = *args;
+    char *r = line;          /* next character to read */
+    char *end = line + length;
+    long ct = 0;
+
+    while (r < end) {
+        switch (*r) {
+            case ' ':
+            case '\t':                                  /* argument separators */
+            case '\r':
+            case '\n':
+            case '\0':
+                r++;
+                continue;
+            case '#':
+                r = end;
+                continue;
+        }
+
+        char *token = operatorToken(&r);
+        if (token != NULL) {
+            argv[ct++] = token;
+            continue;
+        }
+
+        char *word = r;      /* the word is written over itself from here */
+        char *w = r;
+        int quoted = 0;
+        int wildcards = 0;       /* unquoted * ? [ */
+        int quotedWildcards = 0;
+        int substitutions = 0;   /* $(...) and `...` in the word */
+        while (r < end) {
+            size_t n = strcspn(r, WORD_SPECIALS);
+            if (w != r) memmove(w, r, n);
+            w += n;
+            r += n;
+            if (r >= end) break;
+
+            if (*r == '\'') {                           /* nothing is special inside */
+                char *close = memchr(r + 1, '\'', end - r - 1);
+                if (close == NULL) goto unterminated;
+                n = close - (r + 1);
+                quotedWildcards |= memchr(r + 1, '*', n) || memchr(r + 1, '?', n) || memchr(r + 1, '[', n);
+                memmove(w, r + 1, n);
+                w += n;
+                r = close + 1;
+                quoted = 1;
+            } else if (*r == '"') {                     /* only \ escapes " \ $ and ` */
+                r++;
+                while (1) {
+                    n = strcspn(r, "\"\\$`");
+                    quotedWildcards |= memchr(r, '*', n) || memchr(r, '?', n) || memchr(r, '[', n);
+                    memmove(w, r, n);
+                    w += n;
+                    r += n;
+                    if (r >= end) goto unterminated;
+                    if (*r == '"') break;
+                    if (*r == '`' || (*r == '$' && r[1] == '(')) {
+                        r = copySubstitution(r, end, &w, SUBST_QUOTED);
+                        if (r == NULL) goto unterminatedSubstitution;
+                        substitutions++;
+                        continue;
+                    }
+                    if (*r == '$') {
+                        *w++ = *r++;
+                        continue;
+                    }
+                    if (r[1] == '"' || r[1] == '\\' || r[1] == '$' || r[1] == '`') r++;
+                    *w++ = *r++;
+                }
+                r++;
+                quoted = 1;
+            } else if (*r == '\\') {                    /* the next character as is */
+                if (r + 1 < end) r++;
+                quotedWildcards |= *r == '*' || *r == '?' || *r == '[';
+                *w++ = *r++;
+                quoted = 1;
+            } else if (*r == '*' || *r == '?' || *r == '[') {
+                *w++ = *r++;
+                wildcards = 1;
+            } else if (*r == '`' || (*r == '$' && r + 1 < end && r[1] == '(')) {
+                r = copySubstitution(r, end, &w, SUBST_START);
+                if (r == NULL) goto unterminatedSubstitution;
+                substitutions++;
+            } else if (*r == '$') {
+                *w++ = *r++;
+            } else {
+                break;                                  /* a separator or an operator */
+            }
+        }
+
+        /* w == r when nothing was taken out, then *r may be the operator
+        that ended the word and has to be read before the '\0' goes there */
+        token = r < end ? operatorToken(&r) : NULL;
+        *w = '\0';
+        if (substitutions) {                        /* each one brought two markers */
+            long markers = 0;
+            for (char *c = word; c < w; c++) {
+                if (*c == '\0') goto markerInWord;    /* would cut the word short */
+                markers += *c == SUBST_START || *c == SUBST_QUOTED || *c == SUBST_END;
+            }
+            if (markers != 2 * substitutions) goto markerInWord;
+        }
+        if (substitutions) argv[ct++] = substToken;
+        else if (wildcards && !quotedWildcards && isGlobPattern(word)) argv[ct++] = globToken;
+        if (w > word || quoted) argv[ct++] = word;
+        if (token != NULL) argv[ct++] = token;
+    }
+    argv[ct] = NULL;                                    /* no more arguments to this command */
+    return ct;
+
+unterminated:
+    fprintf(stderr, "Syntax error: unterminated quote\n");
+    argv[0] = NULL;
+    return -1;
+
+unterminatedSubstitution:
+    fprintf(stderr, "Syntax error: unterminated command substitution\n");
+    argv[0] = NULL;
+    return -1;
+
+markerInWord:
+    fprintf(stderr, "Syntax error: NUL or \\001-\\003 byte in a command substitution\n");
+    argv[0] = NULL;
+    return -1;
+
+}
+
+// The ')' that closes a $( whose command starts at c, or NULL. Quotes,
+// backslashes and nested parentheses are skipped over, not interpreted.
+char *substitutionEnd(char *c, char *end) {
+
+    int depth = 0;
+    for (; c < end; c++) {
+        if (*c == '\\') {
+            c++;
+        } else if (*c == '\'' || *c == '`') {
+            char *close = memchr(c + 1, *c, end - c - 1);
+            if (close == NULL) return NULL;
+            c = close;
+        } else if (*c == '"') {
+            for (c++; c < end && *c != '"'; c++) {
+                if (*c == '\\') c++;
+            }
+            if (c >= end) return NULL;
+        } else if (*c == '(') {
+            depth++;
+        } else if (*c == ')' && depth-- == 0) {
+            return c;
+        }
+    }
+    return NULL;
+
+}
+
+// Move the command of the $(...) or `...` at r to *w between marker and
+// SUBST_END. The command of $(...) stays as typed, the child shell tokenizes
+// it again; inside `...` a backslash before ` \ or $ is dropped first, as in
+// sh. Both shorten the text, so it is written over itself like the rest of
+// the word. Returns where the word goes on, NULL when the line ends first.
+char *copySubstitution(char *r, char *end, char **w, char marker) {
+
+    char *out = *w;
+    int backquoted = *r == '`';
+    *out++ = marker; // may be where r is when nothing was taken out before
+    if (backquoted) {
+        for (r++; r < end && *r != '`'; r++) {
+            if (*r == '\\' && r + 1 < end && (r[1] == '`' || r[1] == '\\' || r[1] == '$')) r++;
+            *out++ = *r;
+        }
+        if (r >= end) return NULL;
+    } else {
+        char *close = substitutionEnd(r + 2, end);
+        if (close == NULL) return NULL;
+        memmove(out, r + 2, close - (r + 2));
+        out += close - (r + 2);
+        r = close;
+    }
+    *out++ = SUBST_END;
+    *w = out;
+    return r + 1;
+
+}
+
+// Word has a wildcard glob would act on; a lone [ (the test command) is not one
+int isGlobPattern(const char *word) {
+
+    const char *bracket = strchr(word, '[');
+    return strpbrk(word, "*?") != NULL || (bracket != NULL && strchr(bracket, ']') != NULL);
+
+}
+
+// Bump allocation for expanded argument lists, all given back at once
+void *arenaAlloc(size_t size) {
+
+    size = (size + 7) & ~(size_t)7;
+    if (globArena == NULL || globArena->size - globArena->used < size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = malloc(sizeof(ArenaBlock) + blockSize);
+        if (block == NULL) {
+            perror("Error expanding arguments");
+            exit(-1);
+        }
+        block->next = globArena;
+        block->used = 0;
+        block->size = blockSize;
+        globArena = block;
+    }
+    void *memory = globArena->data + globArena->used;
+    globArena->used += size;
+    return memory;
+
+}
+
+// Free every block but the newest, which is kept for the next command
+void arenaReset() {
+
+    if (globArena == NULL) return;
+    ArenaBlock *block = globArena->next;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    globArena->next = NULL;
+    globArena->used = 0;
+
+}
+
+void addArgument(ArgList *list, char *arg) {
+
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char **items = arenaAlloc(capacity * sizeof(char *));
+        if (list->count > 0) memcpy(items, list->items, list->count * sizeof(char *));
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = arg;
+
+}
+
+void addGlobMatch(ArgList *matches, const char *path, size_t length) {
+
+    char *copy = arenaAlloc(length + 1);
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+    addArgument(matches, copy);
+
+}
+
+int compareDirEntries(const void *a, const void *b) {
+
+    return strcmp(((const DirEntry *)a)->name, ((const DirEntry *)b)->name);
+
+}
+
+int compareStrings(const void *a, const void *b) {
+
+    return strcmp(*(char *const *)a, *(char *const *)b);
+
+}
+
+void freeDirListing(DirListing *listing) {
+
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+
+}
+
+// Sorted entries of a directory. Listings are cached by device and inode and
+// read again only when the directory's mtime moves, so globbing the same big
+// directory over and over costs a stat() instead of a readdir() pass. A
+// listing read in the same second its directory changed may miss a later
+// change with the same timestamp, so it is not trusted until it is older.
+// Within one expansion a listing is checked once and never freed, callers
+// keep using it while they recurse.
+DirListing *listDirectory(const char *path) {
+
+    struct stat dirStat;
+    if (stat(path, &dirStat) < 0 || !S_ISDIR(dirStat.st_mode)) {
+        return NULL;
+    }
+
+    unsigned int bucket = (unsigned int)((dirStat.st_dev * 31 + dirStat.st_ino) % DIR_CACHE_SIZE);
+    DirListing **link = &dirCache[bucket];
+    while (*link != NULL && ((*link)->device != dirStat.st_dev || (*link)->inode != dirStat.st_ino)) {
+        link = &(*link)->next;
+    }
+    DirListing *listing = *link;
+    if (listing != NULL) {
+        if (listing->generation == globGeneration || (!listing->racy
+                && listing->mtime.tv_sec == dirStat.st_mtim.tv_sec
+                && listing->mtime.tv_nsec == dirStat.st_mtim.tv_nsec)) {
+            listing->generation = globGeneration;
+            return listing;
+        }
+        *link = listing->next;
+        listing->next = retiredListings;
+        retiredListings = listing;
+        dirCacheCount--;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return NULL;
+    }
+    if (dirCacheCount >= DIR_CACHE_MAX_LISTINGS) {
+        for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+            while (dirCache[i] != NULL) {
+                DirListing *next = dirCache[i]->next;
+                dirCache[i]->next = retiredListings;
+                retiredListings = dirCache[i];
+                dirCache[i] = next;
+            }
+        }
+        dirCacheCount = 0;
+    }
+
+    listing = calloc(1, sizeof(DirListing));
+    listing->device = dirStat.st_dev;
+    listing->inode = dirStat.st_ino;
+    listing->mtime = dirStat.st_mtim;
+    listing->racy = time(NULL) - dirStat.st_mtim.tv_sec < 2;
+    listing->generation = globGeneration;
+
+    // Names go into one buffer as offsets first, it moves while it grows
+    size_t namesCapacity = 4096, namesUsed = 0;
+    int entriesCapacity = 64;
+    listing->names = malloc(namesCapacity);
+    listing->entries = malloc(entriesCapacity * sizeof(DirEntry));
+    size_t *offsets = malloc(entriesCapacity * sizeof(size_t));
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        size_t length = strlen(name) + 1;
+        if (namesUsed + length > namesCapacity) {
+            while (namesUsed + length > namesCapacity) namesCapacity *= 2;
+            listing->names = realloc(listing->names, namesCapacity);
+        }
+        if (listing->count == entriesCapacity) {
+            entriesCapacity *= 2;
+            listing->entries = realloc(listing->entries, entriesCapacity * sizeof(DirEntry));
+            offsets = realloc(offsets, entriesCapacity * sizeof(size_t));
+        }
+
+        unsigned char type = ENTRY_OTHER;
+        if (entry->d_type == DT_DIR) {
+            type = ENTRY_DIR;
+        } else if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat entryStat;
+            if (fstatat(dirfd(dir), name, &entryStat, 0) == 0 && S_ISDIR(entryStat.st_mode)) {
+                type = entry->d_type == DT_LNK ? ENTRY_LINK_TO_DIR : ENTRY_DIR;
+            }
+        }
+        memcpy(listing->names + namesUsed, name, length);
+        offsets[listing->count] = namesUsed;
+        listing->entries[listing->count].length = length - 1;
+        listing->entries[listing->count].type = type;
+        listing->count++;
+        namesUsed += length;
+    }
+    closedir(dir);
+
+    for (int i = 0; i < listing->count; i++) {
+        listing->entries[i].name = listing->names + offsets[i];
+    }
+    free(offsets);
+    qsort(listing->entries, listing->count, sizeof(DirEntry), compareDirEntries);
+
+    listing->next = dirCache[bucket];
+    dirCache[bucket] = listing;
+    dirCacheCount++;
+    return listing;
+
+}
+
+// Make room for extra more bytes after the first length bytes of path
+void reservePath(char **path, size_t *capacity, size_t length, size_t extra) {
+
+    if (length + extra + 2 > *capacity) {
+        *capacity = (length + extra + 2) * 2;
+        *path = realloc(*path, *capacity);
+    }
+
+}
+
+// Every entry below path, for a pattern ending in **
+void globEverything(char **path, size_t *capacity, size_t length, ArgList *matches) {
+
+    (*path)[length] = '\0';
+    DirListing *listing = listDirectory(length > 0 ? *path : ".");
+    if (listing == NULL) return;
+
+    for (int i = 0; i < listing->count; i++) {
+        const char *name = listing->entries[i].name;
+        if (name[0] == '.') continue;
+        size_t nameLength = listing->entries[i].length;
+        reservePath(path, capacity, length, nameLength);
+        memcpy(*path + length, name, nameLength);
+        addGlobMatch(matches, *path, length + nameLength);
+        if (listing->entries[i].type == ENTRY_DIR) {
+            (*path)[length + nameLength] = '/';
+            globEverything(path, capacity, length + nameLength + 1, matches);
+        }
+    }
+
+}
+
+// Match the '/' separated components of rest below path, which is empty or
+// ends with '/'. ** stands for any number of directories, without following
+// symlinks, and a trailing '/' only keeps directories.
+void globPath(char **path, size_t *capacity, size_t length, const char *rest, ArgList *matches) {
+
+    while (*rest == '/') rest++;
+    const char *slash = strchr(rest, '/');
+    size_t componentLength = slash != NULL ? (size_t)(slash - rest) : strlen(rest);
+    const char *next = slash != NULL ? slash + 1 : NULL;
+    while (next != NULL && *next == '/') next++;
+    int last = next == NULL || *next == '\0';
+    int dirOnly = next != NULL;
+
+    char *component = arenaAlloc(componentLength + 1);
+    memcpy(component, rest, componentLength);
+    component[componentLength] = '\0';
+
+    if (!isGlobPattern(component)) {
+        reservePath(path, capacity, length, componentLength);
+        memcpy(*path + length, component, componentLength);
+        length += componentLength;
+        (*path)[length] = '\0';
+        if (!last) {
+            (*path)[length] = '/';
+            globPath(path, capacity, length + 1, next, matches);
+            return;
+        }
+        struct stat entryStat;
+        if (dirOnly ? stat(*path, &entryStat) == 0 && S_ISDIR(entryStat.st_mode) : lstat(*path, &entryStat) == 0) {
+            if (dirOnly) (*path)[length++] = '/';
+            addGlobMatch(matches, *path, length);
+        }
+        return;
+    }
+
+    if (strcmp(component, "**") == 0) {
+        if (last && !dirOnly) {
+            globEverything(path, capacity, length, matches);
+            return;
+        }
+        // no directory at all, then the same ** again inside every one
+        if (last) {
+            (*path)[length] = '\0';
+            if (length > 0) addGlobMatch(matches, *path, length);
+        } else {
+            globPath(path, capacity, length, next, matches);
+        }
+        (*path)[length] = '\0';
+        DirListing *listing = listDirectory(length > 0 ? *path : ".");
+        for (int i = 0; listing != NULL && i < listing->count; i++) {
+            const char *name = listing->entries[i].name;
+            if (name[0] == '.' || listing->entries[i].type != ENTRY_DIR) continue;
+            size_t nameLength = listing->entries[i].length;
+            reservePath(path, capacity, length, nameLength);
+            memcpy(*path + length, name, nameLength);
+            (*path)[length + nameLength] = '/';
+            globPath(path, capacity, length + nameLength + 1, rest, matches);
+        }
+        return;
+    }
+
+    // *.log, log.* and * are most of what gets typed, they skip fnmatch()
+    size_t fixedLength = componentLength - 1;
+    int suffixOnly = component[0] == '*' && strpbrk(component + 1, "*?[") == NULL;
+    int prefixOnly = !suffixOnly && strcspn(component, "*?[") == fixedLength && component[fixedLength] == '*';
+
+    (*path)[length] = '\0';
+    DirListing *listing = listDirectory(length > 0 ? *path : ".");
+    for (int i = 0; listing != NULL && i < listing->count; i++) {
+        const char *name = listing->entries[i].name;
+        size_t nameLength = listing->entries[i].length;
+        if (suffixOnly) {
+            if (name[0] == '.' || nameLength < fixedLength
+                    || memcmp(name + nameLength - fixedLength, component + 1, fixedLength) != 0) continue;
+        } else if (prefixOnly) {
+            if (strncmp(name, component, fixedLength) != 0) continue;
+        } else if (fnmatch(component, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        if ((!last || dirOnly) && listing->entries[i].type == ENTRY_OTHER) continue;
+        reservePath(path, capacity, length, nameLength);
+        memcpy(*path + length, name, nameLength);
+        if (last) {
+            if (dirOnly) (*path)[length + nameLength++] = '/';
+            addGlobMatch(matches, *path, length + nameLength);
+        } else {
+            (*path)[length + nameLength] = '/';
+            globPath(path, capacity, length + nameLength + 1, next, matches);
+        }
+    }
+
+}
+
+// Run command in a child shell with its stdout going into a pipe, *outFd
+// gets the read end. The child joins process group pgid, 0 starts one, and
+// goes through tokenizeLine() and runCommandList() like a line main() read,
+// so builtins, pipelines and nested substitutions all work inside.
+pid_t startSubstitution(char *command, pid_t pgid, int *outFd) {
+
+    int pipeFds[2];
+    *outFd = -1;
+    if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) { // child process
+        setpgid(0, pgid);
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+
+        // A shell of its own: no prompt, no jobs of the parent, the
+        // terminal (if any) comes back to this group after its jobs
+        interactive = 0;
+        shellPgid = getpgrp();
+        foreground_pid = 0;
+        if (jobs != NULL) memset(jobs, 0, jobsCapacity * sizeof(Job *));
+        maxJobId = 0;
+        jobCount = 0;
+
+        size_t length = strchr(command, SUBST_END) - command;
+        command[length] = '\0';
+        char **args = NULL;
+        size_t capacity = 0;
+        long ct = tokenizeLine(command, length, &args, &capacity);
+        int background = 0;
+        if (ct > 0 && args[ct - 1] == backgroundToken) {
+            args[ct - 1] = NULL;
+            background = 1;
+        }
+        lastStatus = ct < 0 ? 2 : 0;
+        if (ct > 0) runCommandList(args, background);
+        fflush(stdout);
+        _exit(lastStatus); // not exit(), the atexit() stats belong to the parent
+    }
+
+    close(pipeFds[1]);
+    if (pid < 0) {
+        perror("Fork failed");
+        close(pipeFds[0]);
+        return -1;
+    }
+    setpgid(pid, pgid == 0 ? pid : pgid); // also from the parent, whichever runs first
+    *outFd = pipeFds[0];
+    return pid;
+
+}
+
+// Read what is there from a substitution's pipe into its buffer, which
+// doubles when full. Returns 0 at EOF.
+int readSubstitution(Substitution *substitution) {
+
+    if (substitution->length == substitution->capacity) {
+        size_t capacity = substitution->capacity == 0 ? CAPTURE_BUFFER_SIZE : substitution->capacity * 2;
+        char *output = realloc(substitution->output, capacity);
+        if (output == NULL) {
+            perror("Error reading command output");
+            return 0;
+        }
+        substitution->output = output;
+        substitution->capacity = capacity;
+    }
+    ssize_t n = read(substitution->fd, substitution->output + substitution->length,
+        substitution->capacity - substitution->length);
+    if (n < 0 && errno == EINTR) return 1;
+    if (n <= 0) return 0;
+    substitution->length += n;
+    return 1;
+
+}
+
+// Run every substitution in args and collect the outputs, in the order they
+// appear; *count of them. The substitutions of one command cannot see each
+// other's results, so all of them are started before any output is read and
+// they run side by side in one foreground process group. Their pipes are
+// polled together, none of them blocks on a full pipe while we wait for
+// another. lastStatus becomes the status of the last one.
+Substitution *runSubstitutions(char *args[], int *count) {
+
+    int total = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] != substToken) continue;
+        for (const char *c = args[++i]; *c != '\0'; c++) {
+            total += *c == SUBST_START || *c == SUBST_QUOTED;
+        }
+    }
+    Substitution *substitutions = calloc(total, sizeof(Substitution));
+    struct pollfd *fds = malloc(total * sizeof(struct pollfd));
+    if (substitutions == NULL || fds == NULL) {
+        perror("Error running command substitution");
+        exit(-1);
+    }
+
+    fflush(stdout); // or the children would print it again
+    pid_t pgid = 0;
+    int started = 0;
+    int open = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] != substToken) continue;
+        for (char *c = args[++i]; *c != '\0'; c++) {
+            if (*c != SUBST_START && *c != SUBST_QUOTED) continue;
+            Substitution *substitution = &substitutions[started++];
+            substitution->pid = startSubstitution(c + 1, pgid, &substitution->fd);
+            if (substitution->pid > 0 && pgid == 0) pgid = substitution->pid;
+            if (substitution->fd >= 0) open++;
+            c = strchr(c, SUBST_END);
+        }
+    }
+
+    if (pgid > 0) {
+        foreground_pid = pgid;
+        setTerminalOwner(pgid);
+    }
+    while (open > 0) {
+        for (int i = 0; i < total; i++) {
+            fds[i].fd = substitutions[i].fd; // poll() skips the closed ones, fd -1
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, total, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Error reading command output");
+            break;
+        }
+        for (int i = 0; i < total; i++) {
+            if (fds[i].revents != 0 && !readSubstitution(&substitutions[i])) {
+                close(substitutions[i].fd);
+                substitutions[i].fd = -1;
+                open--;
+            }
+        }
+    }
+    for (int i = 0; i < total; i++) {
+        if (substitutions[i].fd >= 0) close(substitutions[i].fd);
+        if (substitutions[i].pid > 0) {
+            int status;
+            if (waitForeground(substitutions[i].pid, &status) > 0) lastStatus = exitCode(status);
+        } else {
+            lastStatus = 1;
+        }
+    }
+    if (pgid > 0) {
+        foreground_pid = 0;
+        setTerminalOwner(shellPgid);
+    }
+
+    free(fds);
+    *count = total;
+    return substitutions;
+
+}
+
+// Add the arguments a word with substitutions turns into. An output loses
+// its trailing newlines; outside double quotes it is split at spaces, tabs
+// and newlines like setup() splits a line, and nothing is left of a word
+// that came out empty.
+void addSubstitutedWord(ArgList *expanded, const char *word, Substitution substitutions[], int *next) {
+
+    static char *buffer = NULL;
+    static size_t capacity = 0;
+    size_t length = 0;
+    int inWord = 0; /* text or a quoted substitution since the last split */
+
+    for (const char *c = word; *c != '\0'; c++) {
+        if (*c != SUBST_START && *c != SUBST_QUOTED) {
+            reservePath(&buffer, &capacity, length, 1);
+            buffer[length++] = *c;
+            inWord = 1;
+            continue;
+        }
+        int split = *c == SUBST_START;
+        Substitution *substitution = &substitutions[(*next)++];
+        c = strchr(c, SUBST_END);
+        size_t n = substitution->length;
+        while (n > 0 && substitution->output[n - 1] == '\n') n--;
+
+        reservePath(&buffer, &capacity, length, n);
+        if (!split) {
+            if (n > 0) memcpy(buffer + length, substitution->output, n);
+            length += n;
+            inWord = 1;
+            continue;
+        }
+        for (size_t j = 0; j < n; j++) {
+            char ch = substitution->output[j];
+            if (ch != ' ' && ch != '\t' && ch != '\n') {
+                buffer[length++] = ch;
+                inWord = 1;
+            } else if (inWord) {
+                addGlobMatch(expanded, buffer, length);
+                length = 0;
+                inWord = 0;
+            }
+        }
+    }
+    if (inWord) addGlobMatch(expanded, buffer, length);
+
+}
+
+// Replace every word the tokenizer marked with substToken by what its
+// command substitutions make of it, and every word marked with globToken by
+// its sorted matches, or by itself when nothing matches. The new list and the
+// names live in the arena until the next command is expanded; args comes
+// back unchanged when there is nothing to expand.
+char **expandArgs(char *args[]) {
+
+    static char *path = NULL;
+    static size_t pathCapacity = 0;
+    int i;
+
+    for (i = 0; args[i] != NULL && args[i] != globToken && args[i] != substToken; i++);
+    if (args[i] == NULL) return args;
+
+    arenaReset();
+    while (retiredListings != NULL) {
+        DirListing *next = retiredListings->next;
+        freeDirListing(retiredListings);
+        retiredListings = next;
+    }
+    globGeneration++;
+
+    Substitution *substitutions = NULL;
+    int substitutionCount = 0;
+    int nextSubstitution = 0;
+    ArgList expanded = { NULL, 0, 0 };
+    for (i = 0; args[i] != NULL; i++) {
+        if (args[i] == substToken) {
+            if (substitutions == NULL) substitutions = runSubstitutions(args, &substitutionCount);
+            addSubstitutedWord(&expanded, args[++i], substitutions, &nextSubstitution);
+            continue;
+        }
+        if (args[i] != globToken) {
+            addArgument(&expanded, args[i]);
+            continue;
+        }
+        char *pattern = args[++i];
+        ArgList matches = { NULL, 0, 0 };
+        size_t length = 0;
+        reservePath(&path, &pathCapacity, 0, 1);
+        if (pattern[0] == '/') path[length++] = '/';
+        globPath(&path, &pathCapacity, length, pattern, &matches);
+        if (matches.count == 0) {
+            addArgument(&expanded, pattern);
+            continue;
+        }
+        // A single directory already comes out in order, ** and */x may not
+        int sorted = 1;
+        for (int j = 1; sorted && j < matches.count; j++) {
+            sorted = strcmp(matches.items[j - 1], matches.items[j]) < 0;
+        }
+        if (!sorted) qsort(matches.items, matches.count, sizeof(char *), compareStrings);
+        for (int j = 0; j < matches.count; j++) {
+            addArgument(&expanded, matches.items[j]);
+        }
+    }
+    addArgument(&expanded, NULL);
+
+    for (i = 0; i < substitutionCount; i++) {
+        free(substitutions[i].output);
+    }
+    free(substitutions);
+    return expanded.items;
+
+}
+
+
+int countWords(const char *buffer) {
+
+    int inWord = 0;
+    int wordCount = 0;
+
+    while (*buffer != '\0') {
+        if (isspace((unsigned char)*buffer)) {
+            inWord = 0;
+        } else if (!inWord) {
+            inWord = 1;
+            wordCount++;
+        }
+        buffer++; // Move to the next character
+    }
+    return wordCount;
+
+}
+
+// Interactive shells keep their history in a file shared by every myshell
+// ($MYSHELL_HISTFILE, default ~/.myshell_history). Only the header is read
+// here, entries are found through it when they are needed. -c and scripts
+// keep it in memory unless MYSHELL_HISTFORCE=1 (used by benchmark.sh).
+void openHistory() {
+
+    char *capacity = getenv("MYSHELL_HISTSIZE");
+    if (capacity != NULL && atol(capacity) > 0) {
+        historyCapacity = atol(capacity);
+    }
+
+    char *force = getenv("MYSHELL_HISTFORCE");
+    if (interactive || (force != NULL && strcmp(force, "1") == 0)) {
+        char path[PATH_MAX];
+        char *file = getenv("MYSHELL_HISTFILE");
+        char *home = getenv("HOME");
+        if (file == NULL && home != NULL) {
+            snprintf(path, sizeof(path), "%s/.myshell_history", home);
+            file = path;
+        }
+        if (file != NULL) {
+            historyFd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        }
+        if (historyFd >= 0) {
+            struct stat st;
+            flock(historyFd, LOCK_EX);
+            fstat(historyFd, &st);
+            if (st.st_size == 0) {
+                HistoryHeader header = { HISTORY_MAGIC, 0, sizeof(HistoryHeader), 0 };
+                writeHistory(&header, sizeof(header), 0);
+                st.st_size = sizeof(header);
+            }
+            if ((size_t)st.st_size >= sizeof(HistoryHeader)) {
+                mapHistory(st.st_size);
+            }
+            if (historyData == NULL || memcmp(historyData, HISTORY_MAGIC, 8) != 0) {
+                fprintf(stderr, "%s: not a myshell history file, history will not be saved\n", file);
+                if (historyData != NULL) munmap(historyData, historyMapped);
+                historyData = NULL;
+                historyMapped = 0;
+                close(historyFd);
+                historyFd = -1;
+            } else {
+                flock(historyFd, LOCK_UN);
+            }
+        }
+    }
+
+    if (historyFd < 0) {
+        HistoryHeader header = { HISTORY_MAGIC, 0, sizeof(HistoryHeader), 0 };
+        writeHistory(&header, sizeof(header), 0);
+    }
+
+}
+
+// Make at least size bytes of history addressable. The file is mapped with
+// room to spare so appends rarely need a new mapping.
+void mapHistory(size_t size) {
+
+    if (size <= historyMapped) {
+        return;
+    }
+    size_t newSize = historyMapped == 0 ? 4096 : historyMapped;
+    while (newSize < size) newSize *= 2;
+
+    if (historyFd < 0) {
+        historyData = realloc(historyData, newSize);
+        if (historyData == NULL) {
+            perror("history");
+            exit(-1);
+        }
+        historyMapped = newSize;
+        return;
+    }
+
+    if (newSize < HISTORY_MAP_MIN) newSize = HISTORY_MAP_MIN;
+    if (historyData != NULL) munmap(historyData, historyMapped);
+    historyData = mmap(NULL, newSize, PROT_READ, MAP_SHARED, historyFd, 0);
+    if (historyData == MAP_FAILED) {
+        perror("history");
+        exit(-1);
+    }
+    historyMapped = newSize;
+
+}
+
+// Other shells may append or compact the same file, so every use of the
+// history happens under flock() and starts from the header's dataEnd.
+void lockHistory(int operation) {
+
+    if (historyFd < 0) return;
+    while (flock(historyFd, operation) < 0 && errno == EINTR) {
+        // interrupted by a signal, try again
+    }
+    mapHistory(((HistoryHeader *)historyData)->dataEnd);
+
+}
+
+void unlockHistory() {
+
+    if (historyFd >= 0) flock(historyFd, LOCK_UN);
+
+}
+
+void writeHistory(const void *buffer, size_t length, uint64_t offset) {
+
+    if (historyFd < 0) {
+        mapHistory(offset + length);
+        memcpy(historyData + offset, buffer, length);
+        return;
+    }
+    while (length > 0) {
+        ssize_t n = pwrite(historyFd, buffer, length, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("history");
+            return;
+        }
+        buffer = (const char *)buffer + n;
+        length -= n;
+        offset += n;
+    }
+
+}
+
+void appendHistory(const char *command, size_t length) {
+
+    if (length == 0) {
+        return;
+    }
+
+    lockHistory(LOCK_EX);
+    HistoryHeader header = *(HistoryHeader *)historyData;
+
+    uint32_t length32 = length;
+    char *record = malloc(length + 2 * sizeof(uint32_t));
+    memcpy(record, &length32, sizeof(uint32_t));
+    memcpy(record + sizeof(uint32_t), command, length);
+    memcpy(record + sizeof(uint32_t) + length, &length32, sizeof(uint32_t));
+    writeHistory(record, length + 2 * sizeof(uint32_t), header.dataEnd);
+    free(record);
+
+    // The header is only updated once the record is in place
+    header.dataEnd += length + 2 * sizeof(uint32_t);
+    header.entryCount++;
+    writeHistory(&header, sizeof(header), 0);
+    mapHistory(header.dataEnd);
+
+    if (header.entryCount > historyCapacity + historyCapacity / 4) {
+        compactHistory();
+    }
+    unlockHistory();
+
+}
+
+// Drop everything but the newest historyCapacity entries, in place so other
+// shells keep their mapping. Called with the lock held.
+void compactHistory() {
+
+    HistoryHeader header = *(HistoryHeader *)historyData;
+    uint64_t keepFrom = header.dataEnd;
+    uint32_t length;
+
+    for (uint64_t i = 0; i < historyCapacity && keepFrom > sizeof(HistoryHeader); i++) {
+        memcpy(&length, historyData + keepFrom - sizeof(uint32_t), sizeof(uint32_t));
+        keepFrom -= length + 2 * sizeof(uint32_t);
+    }
+
+    // Through a bounce buffer, source and destination overlap in the same file
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    uint64_t to = sizeof(HistoryHeader);
+    for (uint64_t from = keepFrom; from < header.dataEnd; ) {
+        size_t n = header.dataEnd - from < COPY_BUFFER_SIZE ? header.dataEnd - from : COPY_BUFFER_SIZE;
+        memcpy(buffer, historyData + from, n);
+        writeHistory(buffer, n, to);
+        from += n;
+        to += n;
+    }
+    free(buffer);
+
+    header.dataEnd = to;
+    header.entryCount = historyCapacity;
+    header.generation++;
+    writeHistory(&header, sizeof(header), 0);
+    if (historyFd >= 0) {
+        if (ftruncate(historyFd, header.dataEnd) < 0) perror("history");
+    }
+
+}
+
+// Entry index 0 is the newest one. Called with the lock held.
+const char *historyEntry(uint64_t index, uint32_t *length) {
+
+    HistoryHeader *header = (HistoryHeader *)historyData;
+    if (index >= header->entryCount) {
+        return NULL;
+    }
+
+    uint64_t end = header->dataEnd;
+    while (1) {
+        memcpy(length, historyData + end - sizeof(uint32_t), sizeof(uint32_t));
+        end -= *length + sizeof(uint32_t);
+        if (index == 0) {
+            return historyData + end;
+        }
+        end -= sizeof(uint32_t);
+        index--;
+    }
+
+}
+
+void addToHistory(const char *line) {
+
+    appendHistory(line, strlen(line));
+
+}
+
+void addToHistoryForHistoryCommand(char args[]) {
+
+    if (args == NULL || strlen(args) == 0) {
+        return;
+    }
+
+    appendHistory(args, strlen(args));
+}
+
+
+
+void printHistory() {
+
+    lockHistory(LOCK_SH);
+
+    uint32_t length;
+    for (int i = 0; i < HISTORY_SIZE; i++) {
+        const char *command = historyEntry(i, &length);
+        if (command == NULL) break;
+        printf("%d %.*s\n", i, (int)length, command);
+    }
+
+    unlockHistory();
+
+}
+
+// Runs on copies of the entry, so the line that asked for it and the args
+// runCommandList() is working through stay untouched.
+void historyCommand(int index) {
+
+    uint32_t length;
+    const char *command = NULL;
+    char *line = NULL;
+
+    lockHistory(LOCK_SH);
+    if (index >= 0) {
+        command = historyEntry(index, &length);
+    }
+    if (command != NULL) {
+        line = strndup(command, length);
+    }
+    unlockHistory();
+
+    if (command == NULL) {
+        fprintf(stderr, "Invalid history index.\n");
+        lastStatus = 1;
+        return;
+    }
+    if (historyDepth > 0) {
+        fprintf(stderr, "history -i: the entry runs history -i itself\n");
+        free(line);
+        lastStatus = 1;
+        return;
+    }
+
+    // Retrieve the command from history
+    
+    printf("Executing command from history: %s\n", line);
+
+    addToHistoryForHistoryCommand(line);
+
+    char **args = NULL;
+    size_t capacity = 0;
+    long ct = tokenizeLine(line, length, &args, &capacity);
+    int background = 0;
+    if (ct > 0 && args[ct - 1] == backgroundToken) {
+        args[ct - 1] = NULL;
+        background = 1;
+    }
+
+    if (args[0] != NULL) {
+        historyDepth++;
+        runCommandList(args, background);
+        historyDepth--;
+    }
+    free(args);
+    free(line);
+
+}
+
+void postingAdd(PostingList *list, uint32_t id) {
+
+    if (list->count > 0 && list->ids[list->count - 1] == id) {
+        return; // the same trigram twice in one entry
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        list->ids = realloc(list->ids, list->capacity * sizeof(uint32_t));
+    }
+    list->ids[list->count++] = id;
+
+}
+
+PostingList *trigramList(uint32_t trigram, int create) {
+
+    uint32_t key = trigram | 1u << 24;
+
+    if (create && (trigramCount + 1) * 2 > trigramTableSize) {
+        uint32_t newSize = trigramTableSize == 0 ? 4096 : trigramTableSize * 2;
+        TrigramSlot *newTable = calloc(newSize, sizeof(TrigramSlot));
+        for (uint32_t i = 0; i < trigramTableSize; i++) {
+            if (trigramTable[i].key == 0) continue;
+            uint32_t slot = (trigramTable[i].key * 2654435761u) & (newSize - 1);
+            while (newTable[slot].key != 0) slot = (slot + 1) & (newSize - 1);
+            newTable[slot] = trigramTable[i];
+        }
+        free(trigramTable);
+        trigramTable = newTable;
+        trigramTableSize = newSize;
+    }
+    if (trigramTableSize == 0) {
+        return NULL;
+    }
+
+    uint32_t slot = (key * 2654435761u) & (trigramTableSize - 1);
+    while (trigramTable[slot].key != 0) {
+        if (trigramTable[slot].key == key) {
+            return &trigramTable[slot].list;
+        }
+        slot = (slot + 1) & (trigramTableSize - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+    trigramTable[slot].key = key;
+    trigramCount++;
+    return &trigramTable[slot].list;
+
+}
+
+void resetHistoryIndex() {
+
+    for (uint32_t i = 0; i < trigramTableSize; i++) {
+        free(trigramTable[i].list.ids);
+    }
+    free(trigramTable);
+    trigramTable = NULL;
+    trigramTableSize = 0;
+    trigramCount = 0;
+
+    if (prefixIndex != NULL) {
+        for (int i = 0; i < 65536; i++) {
+            free(prefixIndex[i].ids);
+        }
+        free(prefixIndex);
+        prefixIndex = NULL;
+    }
+
+    historyIndexedCount = 0;
+    historyIndexedEnd = sizeof(HistoryHeader);
+
+}
+
+// Index the entries added since the last search, by us or by other shells.
+// Called with the lock held.
+void syncHistoryIndex() {
+
+    HistoryHeader *header = (HistoryHeader *)historyData;
+
+    if (historyIndexedEnd == 0 || header->generation != historyIndexedGeneration) {
+        resetHistoryIndex();
+        historyIndexedGeneration = header->generation;
+    }
+    if (prefixIndex == NULL) {
+        prefixIndex = calloc(65536, sizeof(PostingList));
+    }
+
+    while (historyIndexedEnd < header->dataEnd) {
+        uint32_t length;
+        memcpy(&length, historyData + historyIndexedEnd, sizeof(uint32_t));
+        const unsigned char *text = (const unsigned char *)historyData + historyIndexedEnd + sizeof(uint32_t);
+        uint32_t id = historyIndexedCount;
+
+        if (historyIndexedCount == historyOffsetsCapacity) {
+            historyOffsetsCapacity = historyOffsetsCapacity == 0 ? 1024 : historyOffsetsCapacity * 2;
+            historyOffsets = realloc(historyOffsets, historyOffsetsCapacity * sizeof(uint64_t));
+        }
+        historyOffsets[id] = historyIndexedEnd;
+
+        if (length >= 2) {
+            postingAdd(&prefixIndex[text[0] << 8 | text[1]], id);
+        }
+        for (uint32_t i = 0; i + 3 <= length; i++) {
+            postingAdd(trigramList(text[i] << 16 | text[i + 1] << 8 | text[i + 2], 1), id);
+        }
+
+        historyIndexedCount++;
+        historyIndexedEnd += length + 2 * sizeof(uint32_t);
+    }
+
+}
+
+// history -s <prefix>, history -g <text>; newest match first, numbered like
+// history so the result can be run with history -i.
+void searchHistory(const char *query, int prefixOnly) {
+
+    const unsigned char *q = (const unsigned char *)query;
+    size_t queryLength = strlen(query);
+
+    lockHistory(LOCK_SH);
+    syncHistoryIndex();
+
+    // Only entries in the candidate list can match; without one, scan them all
+    PostingList *candidates = NULL;
+    int noMatch = 0;
+    if (prefixOnly && queryLength >= 2) {
+        candidates = &prefixIndex[q[0] << 8 | q[1]];
+    } else if (!prefixOnly && queryLength >= 3) {
+        for (size_t i = 0; i + 3 <= queryLength; i++) {
+            PostingList *list = trigramList(q[i] << 16 | q[i + 1] << 8 | q[i + 2], 0);
+            if (list == NULL) {
+                noMatch = 1;
+                break;
+            }
+            if (candidates == NULL || list->count < candidates->count) {
+                candidates = list;
+            }
+        }
+    }
+
+    uint64_t total = candidates != NULL ? candidates->count : historyIndexedCount;
+    for (uint64_t n = total; n > 0 && !noMatch; n--) {
+        uint32_t id = candidates != NULL ? candidates->ids[n - 1] : n - 1;
+        uint32_t length;
+        memcpy(&length, historyData + historyOffsets[id], sizeof(uint32_t));
+        const char *text = historyData + historyOffsets[id] + sizeof(uint32_t);
+
+        int match;
+        if (prefixOnly) {
+            match = length >= queryLength && memcmp(text, query, queryLength) == 0;
+        } else {
+            match = memmem(text, length, query, queryLength) != NULL;
+        }
+        if (match) {
+            printf("%llu %.*s\n", (unsigned long long)(historyIndexedCount - 1 - id), (int)length, text);
+        }
+    }
+
+    unlockHistory();
+
+}
+
+
+// fg %num, num is a job id or a pid
+void moveBackgroundToForeground(int number) {
+
+    Job *job = findJob(number);
+    if (job == NULL) {
+        fprintf(stderr, "No such background process.\n");
+        return;
+    }
+    waitForJob(job);
+    removeJob(job);
+
+}
+
+
+// exit [n]: n, or like at the end of input the last command's status for -c
+// and scripts and 0 for an interactive shell
+void exitRequest(char *args[]) {
+
+    int status = interactive ? 0 : lastStatus;
+    if (args[1] != NULL) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0') {
+            fprintf(stderr, "exit: %s: numeric argument required\n", args[1]);
+            n = 2;
+        }
+        status = n & 0xff;
+    }
+
+    if (jobCount > 0) {
+        printf("There are %d background processes running.\n", jobCount);
+        for (int id = 1; id <= maxJobId; id++) {
+            if (jobs[id] == NULL) continue;
+            for (int i = 0; i < jobs[id]->processCount; i++) {
+                if (!jobs[id]->processes[i].done) {
+                    printf("PID: %d\n", jobs[id]->processes[i].pid);
+                }
+            }
+        }
+        if (!interactive) {
+            exit(status); // nobody to ask, leave them running like other shells do
+        }
+        printf("Do you want to terminate all background processes and exit? (y/n): ");
+        fflush(stdout);
+        // The answer goes through the same reader, stdio would miss buffered input
+        size_t length;
+        char *answer = readLine(&inputReader, &length);
+        char choice = answer != NULL ? answer[0] : 'n';
+        if (choice == 'y' || choice == 'Y') {
+            for (int id = 1; id <= maxJobId; id++) {
+                if (jobs[id] == NULL) continue;
+                for (int i = 0; i < jobs[id]->processCount; i++) {
+                    if (!jobs[id]->processes[i].done) {
+                        kill(jobs[id]->processes[i].pid, SIGKILL);
+                    }
+                }
+            }
+            exit(status);
+        }
+        return;
+    }
+    else{
+        exit(status);
+    }
+
+}
+
+
+// args joined with blanks, in a new string
+char *joinArgs(char *args[]) {
+
+    size_t length = 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        length += strlen(args[i]) + 1;
+    }
+
+    char *command = malloc(length);
+    char *end = command;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (i > 0) *end++ = ' ';
+        size_t n = strlen(args[i]);
+        memcpy(end, args[i], n);
+        end += n;
+    }
+    *end = '\0';
+    return command;
+
+}
+
+// Register a background job; takes ownership of command.
+Job *addJob(pid_t pids[], int count, pid_t pgid, char *command) {
+
+    Job *job = malloc(sizeof(Job));
+    job->id = maxJobId + 1;
+    job->pgid = pgid;
+    job->processes = malloc(count * sizeof(JobProcess));
+    job->processCount = 0;
+    job->running = 0;
+    job->status = 0;
+    job->command = command;
+
+    if (job->id >= jobsCapacity) {
+        int newCapacity = jobsCapacity == 0 ? 16 : jobsCapacity * 2;
+        jobs = realloc(jobs, newCapacity * sizeof(Job *));
+        memset(jobs + jobsCapacity, 0, (newCapacity - jobsCapacity) * sizeof(Job *));
+        jobsCapacity = newCapacity;
+    }
+    jobs[job->id] = job;
+    maxJobId = job->id;
+    jobCount++;
+
+    // Keep the pid table at most one entry per bucket on average
+    if (pidTableCount + count > pidTableSize) {
+        int newSize = pidTableSize == 0 ? PID_TABLE_MIN_SIZE : pidTableSize;
+        while (newSize < pidTableCount + count) newSize *= 2;
+        PidEntry **newTable = calloc(newSize, sizeof(PidEntry *));
+        for (int i = 0; i < pidTableSize; i++) {
+            PidEntry *entry = pidTable[i];
+            while (entry) {
+                PidEntry *next = entry->next;
+                entry->next = newTable[entry->pid % newSize];
+                newTable[entry->pid % newSize] = entry;
+                entry = next;
+            }
+        }
+        free(pidTable);
+        pidTable = newTable;
+        pidTableSize = newSize;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pids[i] <= 0) continue; // stage that failed to start
+        job->processes[job->processCount].pid = pids[i];
+        job->processes[job->processCount].done = 0;
+        job->processCount++;
+        job->running++;
+
+        PidEntry *entry = malloc(sizeof(PidEntry));
+        entry->pid = pids[i];
+        entry->job = job;
+        entry->next = pidTable[pids[i] % pidTableSize];
+        pidTable[pids[i] % pidTableSize] = entry;
+        pidTableCount++;
+    }
+    return job;
+
+}
+
+void removeJob(Job *job) {
+
+    for (int i = 0; i < job->processCount; i++) {
+        PidEntry **link = &pidTable[job->processes[i].pid % pidTableSize];
+        while (*link) {
+            if ((*link)->pid == job->processes[i].pid) {
+                PidEntry *entry = *link;
+                *link = entry->next;
+                free(entry);
+                pidTableCount--;
+                break;
+            }
+            link = &(*link)->next;
+        }
+    }
+
+    jobs[job->id] = NULL;
+    jobCount--;
+    while (maxJobId > 0 && jobs[maxJobId] == NULL) {
+        maxJobId--;
+    }
+    free(job->processes);
+    free(job->command);
+    free(job);
+
+}
+
+// %n in fg/kill/wait is a job id, or the pid of one of the job's processes
+Job *findJob(int number) {
+
+    if (number > 0 && number <= maxJobId && jobs[number] != NULL) {
+        return jobs[number];
+    }
+    return findJobByPid(number);
+
+}
+
+Job *findJobByPid(pid_t pid) {
+
+    if (pidTableSize == 0 || pid <= 0) {
+        return NULL;
+    }
+    for (PidEntry *entry = pidTable[pid % pidTableSize]; entry; entry = entry->next) {
+        if (entry->pid == pid) {
+            return entry->job;
+        }
+    }
+    return NULL;
+
+}
+
+void markProcessDone(pid_t pid, int status) {
+
+    Job *job = findJobByPid(pid);
+    if (job == NULL) {
+        return;
+    }
+    for (int i = 0; i < job->processCount; i++) {
+        if (job->processes[i].pid == pid && !job->processes[i].done) {
+            job->processes[i].done = 1;
+            job->running--;
+            if (i == job->processCount - 1) {
+                job->status = status;
+            }
+        }
+    }
+
+}
+
+// Block until every process of the job has finished
+void waitForJob(Job *job) {
+
+    foreground_pid = job->pgid;
+    setTerminalOwner(job->pgid);
+    kill(-job->pgid, SIGCONT); // stopped by SIGTTIN when it read the terminal in the background
+    for (int i = 0; i < job->processCount; i++) {
+        if (job->processes[i].done) continue;
+        int status = 0;
+        waitForeground(job->processes[i].pid, &status);
+        markProcessDone(job->processes[i].pid, status);
+    }
+    setTerminalOwner(shellPgid);
+    foreground_pid = 0;
+
+}
+
+// Collect every finished child without blocking. Only called while no
+// foreground command runs, so nothing we wait for explicitly is taken.
+void reapChildren() {
+
+    struct signalfd_siginfo info;
+    while (signalFd >= 0 && read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+        // drained; one SIGCHLD may stand for many children
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitChild(-1, &status, WNOHANG)) > 0) {
+        markProcessDone(pid, status);
+    }
+
+}
+
+// Sleep until fd has input, reaping background jobs as they finish
+void waitForInput(int fd) {
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = signalFd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if (poll(fds, signalFd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return; // let read() report the problem
+        }
+        if (fds[1].revents & POLLIN) {
+            reapChildren();
+        }
+        if (fds[0].revents != 0) {
+            return;
+        }
+    }
+
+}
+
+// [1] Done    sleep 5
+void printJobNotices() {
+
+    reapChildren();
+    for (int id = 1; id <= maxJobId; id++) {
+        Job *job = jobs[id];
+        if (job == NULL || job->running > 0) continue;
+        if (WIFEXITED(job->status) && WEXITSTATUS(job->status) != 0) {
+            printf("[%d] Exit %d\t%s\n", job->id, WEXITSTATUS(job->status), job->command);
+        } else if (WIFSIGNALED(job->status)) {
+            printf("[%d] Killed (signal %d)\t%s\n", job->id, WTERMSIG(job->status), job->command);
+        } else {
+            printf("[%d] Done\t%s\n", job->id, job->command);
+        }
+        removeJob(job);
+    }
+
+}
+
+// jobs
+int jobsBuiltin(char *args[]) {
+
+    (void)args;
+    printJobNotices(); // finished jobs are reported once and dropped
+    for (int id = 1; id <= maxJobId; id++) {
+        Job *job = jobs[id];
+        if (job == NULL) continue;
+        printf("[%d] Running  pgid %d\t%s\n", job->id, job->pgid, job->command);
+    }
+    return 0;
+
+}
+
+// wait, wait %n...
+int waitBuiltin(char *args[]) {
+
+    if (args[1] == NULL) {
+        for (int id = 1; id <= maxJobId; id++) {
+            if (jobs[id] == NULL) continue;
+            waitForJob(jobs[id]);
+            removeJob(jobs[id]);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        Job *job = findJob(atoi(args[i][0] == '%' ? &args[i][1] : args[i]));
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        waitForJob(job);
+        removeJob(job);
+    }
+    return status;
+
+}
+
+// kill [-signal] %n|pid...
+int killBuiltin(char *args[]) {
+
+    static const struct { const char *name; int number; } signalNames[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "KILL", SIGKILL }, { "TERM", SIGTERM },
+        { "STOP", SIGSTOP }, { "CONT", SIGCONT }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+    };
+    int signum = SIGTERM;
+    int i = 1;
+
+    if (args[1] != NULL && args[1][0] == '-') {
+        char *name = &args[1][1];
+        if (strncmp(name, "SIG", 3) == 0) name += 3;
+        signum = isdigit((unsigned char)name[0]) ? atoi(name) : -1;
+        for (size_t n = 0; signum < 0 && n < sizeof(signalNames) / sizeof(signalNames[0]); n++) {
+            if (strcmp(name, signalNames[n].name) == 0) signum = signalNames[n].number;
+        }
+        if (signum < 0) {
+            fprintf(stderr, "kill: %s: invalid signal\n", args[1]);
+            return 1;
+        }
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "Usage: kill [-signal] %%<job>|<pid>...\n");
+        return 2;
+    }
+
+    int status = 0;
+    for (; args[i] != NULL; i++) {
+        if (args[i][0] != '%') {
+            if (kill(atoi(args[i]), signum) < 0) {
+                perror("kill");
+                status = 1;
+            }
+            continue;
+        }
+        Job *job = findJob(atoi(&args[i][1]));
+        if (job == NULL) {
+            fprintf(stderr, "kill: %s: no such job\n", args[i]);
+            status = 1;
+            continue;
+        }
+        for (int p = 0; p < job->processCount; p++) {
+            if (!job->processes[p].done) kill(job->processes[p].pid, signum);
+        }
+    }
+    return status;
+
+}
+
+
+void handleRedirection(char *args[]) {
+
+    int i = 0;
+
+    while (args[i] != NULL) {
+
+        int flags, sourceFd;
+        int targetFd = redirectionTarget(args[i], &flags, &sourceFd);
+
+        if (targetFd >= 0 && sourceFd >= 0) {
+            dup2(sourceFd, targetFd);
+            args[i] = NULL;
+        } 
+        else if (targetFd >= 0) {
+            if (args[i + 1] == NULL) {
+                fprintf(stderr, "Missing file name after %s\n", args[i]);
+                exit(1);
+            }
+            int fd = open(args[i + 1], flags, 0644);
+            if (fd < 0) {
+                perror(targetFd == STDIN_FILENO ? "Error opening file for input redirection"
+                    : targetFd == STDOUT_FILENO ? "Error opening file for output redirection"
+                    : "Error opening file for error redirection");
+                exit(1);
+            }
+            dup2(fd, targetFd);
+            close(fd);
+            args[i] = NULL;
+        }
+
+        i++;
+    }
+    
+}
+
+unsigned int hashCommandName(const char *name) {
+
+    unsigned int hash = 5381;
+
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char)*name;
+        name++;
+    }
+    return hash % COMMAND_CACHE_SIZE;
+
+}
+
+void clearCommandCache() {
+
+    for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+        CommandCacheEntry *entry = commandCache[i];
+        while (entry) {
+            CommandCacheEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        commandCache[i] = NULL;
+    }
+
+}
+
+// Split a private copy of PATH into directories and remember their mtimes.
+// strtok on getenv("PATH") itself would overwrite the real environment.
+void loadPathDirs(const char *pathEnv) {
+
+    free(cachedPathEnv);
+    free(pathDirsBuffer);
+    free(pathDirs);
+    free(pathDirMtimes);
+
+    cachedPathEnv = strdup(pathEnv);
+    pathDirsBuffer = strdup(pathEnv);
+    pathDirCount = 0;
+
+    int maxDirs = 1;
+    for (const char *c = pathEnv; *c != '\0'; c++) {
+        if (*c == ':') maxDirs++;
+    }
+    pathDirs = malloc(maxDirs * sizeof(char *));
+    pathDirMtimes = calloc(maxDirs, sizeof(struct timespec));
+
+    char *savePtr;
+    char *pathDir = strtok_r(pathDirsBuffer, ":", &savePtr);
+    while (pathDir) {
+        struct stat st;
+        if (stat(pathDir, &st) == 0) {
+            pathDirMtimes[pathDirCount] = st.st_mtim;
+        }
+        pathDirs[pathDirCount++] = pathDir;
+        pathDir = strtok_r(NULL, ":", &savePtr);
+    }
+    lastPathCheck = time(NULL);
+
+}
+
+// Drop every cached lookup when PATH was changed or one of its directories
+// was modified (a command may have been added in front of a cached one).
+void validateCommandCache() {
+
+    const char *pathEnv = getenv("PATH");
+    if (!pathEnv) pathEnv = "";
+
+    if (cachedPathEnv == NULL || strcmp(cachedPathEnv, pathEnv) != 0) {
+        clearCommandCache();
+        loadPathDirs(pathEnv);
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (now - lastPathCheck < PATH_RECHECK_INTERVAL) {
+        return;
+    }
+    lastPathCheck = now;
+
+    int changed = 0;
+    for (int i = 0; i < pathDirCount; i++) {
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(pathDirs[i], &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if (mtime.tv_sec != pathDirMtimes[i].tv_sec || mtime.tv_nsec != pathDirMtimes[i].tv_nsec) {
+            pathDirMtimes[i] = mtime;
+            changed = 1;
+        }
+    }
+    if (changed) {
+        clearCommandCache();
+    }
+
+}
+
+// Find the cache entry for a command name, searching PATH on a miss.
+CommandCacheEntry *lookupCommand(const char *name) {
+
+    validateCommandCache();
+
+    unsigned int bucket = hashCommandName(name);
+    CommandCacheEntry **link = &commandCache[bucket];
+    while (*link) {
+        CommandCacheEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            if (access(entry->path, X_OK) == 0) {
+                return entry;
+            }
+            // The binary went away, forget it and search again
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            break;
+        }
+        link = &entry->next;
+    }
+
+    for (int i = 0; i < pathDirCount; i++) {
+        snprintf(commandPath, sizeof(commandPath), "%s/%s", pathDirs[i], name);
+        if (access(commandPath, X_OK) == 0) {
+            CommandCacheEntry *entry = malloc(sizeof(CommandCacheEntry));
+            entry->name = strdup(name);
+            entry->path = strdup(commandPath);
+            entry->hits = 0;
+            entry->next = commandCache[bucket];
+            commandCache[bucket] = entry;
+            return entry;
+        }
+    }
+    return NULL;
+
+}
+
+// Return the full path of a command, or NULL if it is not in PATH.
+// Names with a '/' are used as they are.
+char *findCommand(const char *name) {
+
+    if (strchr(name, '/') != NULL) {
+        return access(name, X_OK) == 0 ? (char *)name : NULL;
+    }
+
+    CommandCacheEntry *entry = lookupCommand(name);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hits++;
+    return entry->path;
+
+}
+
+// hash, hash -r, hash <name>...
+int hashBuiltin(char *args[]) {
+
+    if (args[1] == NULL) {
+        int empty = 1;
+        validateCommandCache();
+        for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+            for (CommandCacheEntry *entry = commandCache[i]; entry; entry = entry->next) {
+                if (empty) {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (empty) {
+            printf("hash: hash table empty\n");
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0) {
+        clearCommandCache();
+        free(cachedPathEnv);
+        cachedPathEnv = NULL;
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strchr(args[i], '/') != NULL || lookupCommand(args[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+
+}
+
+// Same rules as handleRedirection(), but the files are opened by
+// posix_spawn in the child instead of by us after a fork.
+int addSpawnRedirections(char *args[], posix_spawn_file_actions_t *actions) {
+
+    int i = 0;
+
+    while (args[i] != NULL) {
+
+        int flags, sourceFd;
+        int targetFd = redirectionTarget(args[i], &flags, &sourceFd);
+
+        if (targetFd >= 0 && sourceFd >= 0) {
+            posix_spawn_file_actions_adddup2(actions, sourceFd, targetFd);
+            args[i] = NULL;
+        } else if (targetFd >= 0) {
+            if (args[i + 1] == NULL) {
+                fprintf(stderr, "Missing file name after %s\n", args[i]);
+                return -1;
+            }
+            posix_spawn_file_actions_addopen(actions, targetFd, args[i + 1], flags, 0644);
+            args[i] = NULL;
+        }
+
+        i++;
+    }
+    return 0;
+
+}
+
+// glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK), so the
+// child borrows our memory until it execs and launch cost does not grow
+// with the size of the shell.
+// inFd/outFd/errFd become stdin/stdout/stderr when they are not -1, and the child joins
+// process group pgid (0 = a new group) when pgid is not -1.
+pid_t spawnCommand(char *path, char *args[], int inFd, int outFd, int errFd, pid_t pgid) {
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+
+    // posix_spawn has no hook for affinity, ioprio or rlimits
+    if (launchSettings != NULL) {
+        return forkCommand(path, args, inFd, outFd, errFd, pgid);
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    if (inFd >= 0) posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    if (outFd >= 0) posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    if (errFd >= 0) posix_spawn_file_actions_adddup2(&actions, errFd, STDERR_FILENO);
+    posix_spawnattr_setsigmask(&attr, &originalSignalMask);
+    sigset_t defaultSignals; // we ignore SIGTTOU, the command must not
+    sigemptyset(&defaultSignals);
+    sigaddset(&defaultSignals, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+        if (giveTerminal && terminalFd >= 0) {
+            // the child takes the terminal before exec, so it can never read it too early
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, terminalFd);
+        }
+    } else {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    }
+
+    int err = -1;
+    if (addSpawnRedirections(args, &actions) == 0) {
+        err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+        } else {
+            trackProcess(pid, args[0]);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return err == 0 ? pid : -1;
+
+}
+
+pid_t forkCommand(char *path, char *args[], int inFd, int outFd, int errFd, pid_t pgid) {
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return -1;
+    }
+    if (pid == 0) { // child process
+        sigprocmask(SIG_SETMASK, &originalSignalMask, NULL);
+        if (pgid >= 0) setpgid(0, pgid);
+        if (pgid >= 0 && giveTerminal && terminalFd >= 0) tcsetpgrp(terminalFd, getpgrp());
+        signal(SIGTTOU, SIG_DFL);
+        if (launchSettings != NULL) applyLaunchSettings(launchSettings);
+        if (inFd >= 0) dup2(inFd, STDIN_FILENO);
+        if (outFd >= 0) dup2(outFd, STDOUT_FILENO);
+        if (errFd >= 0) dup2(errFd, STDERR_FILENO);
+        handleRedirection(args);
+        execv(path, args);
+        perror("execv failed");
+        exit(1);
+    }
+    if (pgid >= 0) setpgid(pid, pgid); // also from the parent, whichever runs first
+    trackProcess(pid, args[0]);
+    return pid;
+
+}
+
+// Start settings from the pin -f / pin -b defaults for this kind of job
+void initLaunchSettings(LaunchSettings *settings, int background) {
+
+    memset(settings, 0, sizeof(*settings));
+    settings->ioPriority = -1;
+    LaunchSettings *defaults = background ? &backgroundDefaults : &foregroundDefaults;
+    if (defaults->pinned) {
+        settings->pinned = 1;
+        settings->cpus = defaults->cpus;
+    }
+
+}
+
+int hasLaunchSettings(LaunchSettings *settings) {
+
+    return settings->pinned || settings->niceSet || settings->ioPriority >= 0 || settings->limitCount > 0;
+
+}
+
+// "2-5,7" -> cpus
+int parseCpuList(const char *text, cpu_set_t *cpus) {
+
+    CPU_ZERO(cpus);
+    while (*text != '\0') {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text || first < 0) return -1;
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        text = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+
+}
+
+void printCpuList(cpu_set_t *cpus) {
+
+    const char *separator = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) last++;
+        if (last == cpu) printf("%s%d", separator, cpu);
+        else printf("%s%d-%d", separator, cpu, last);
+        separator = ",";
+        cpu = last;
+    }
+
+}
+
+// 512M, 2G, 100 or unlimited
+int parseLimitValue(const char *text, rlim_t *value) {
+
+    if (strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text) return -1;
+    switch (*end) {
+        case 'k': case 'K': number <<= 10; end++; break;
+        case 'm': case 'M': number <<= 20; end++; break;
+        case 'g': case 'G': number <<= 30; end++; break;
+        case 't': case 'T': number <<= 40; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *value = number;
+    return 0;
+
+}
+
+// Take the pin, nice, ionice and limit words off the front of args into
+// settings. Returns the command that follows, or NULL after printing why
+// the prefixes could not be used. pin with nothing or an option after it
+// is the pin builtin, not a prefix.
+char **parseLaunchPrefixes(char *args[], LaunchSettings *settings) {
+
+    while (args[0] != NULL) {
+        if (strcmp(args[0], "pin") == 0 && args[1] != NULL && args[1][0] != '-') {
+            if (parseCpuList(args[1], &settings->cpus) < 0) {
+                fprintf(stderr, "pin: bad CPU list: %s\n", args[1]);
+                return NULL;
+            }
+            settings->pinned = 1;
+            args += 2;
+        } else if (strcmp(args[0], "nice") == 0) {
+            int increment = 10;
+            args++;
+            if (args[0] != NULL && strcmp(args[0], "-n") == 0) {
+                if (args[1] == NULL) {
+                    fprintf(stderr, "Usage: nice [-n adjustment] command\n");
+                    return NULL;
+                }
+                increment = atoi(args[1]);
+                args += 2;
+            }
+            settings->niceSet = 1;
+            settings->niceIncrement += increment;
+        } else if (strcmp(args[0], "ionice") == 0) {
+            int class = IOPRIO_CLASS_BE, level = 4;
+            args++;
+            while (args[0] != NULL && args[1] != NULL
+                    && (strcmp(args[0], "-c") == 0 || strcmp(args[0], "-n") == 0)) {
+                if (args[0][1] == 'c') {
+                    class = strcmp(args[1], "idle") == 0 ? IOPRIO_CLASS_IDLE
+                        : strcmp(args[1], "best-effort") == 0 ? IOPRIO_CLASS_BE
+                        : strcmp(args[1], "realtime") == 0 ? IOPRIO_CLASS_RT : atoi(args[1]);
+                } else {
+                    level = atoi(args[1]);
+                }
+                args += 2;
+            }
+            if (class < IOPRIO_CLASS_RT || class > IOPRIO_CLASS_IDLE || level < 0 || level > 7) {
+                fprintf(stderr, "Usage: ionice [-c 1-3|realtime|best-effort|idle] [-n 0-7] command\n");
+                return NULL;
+            }
+            settings->ioPriority = class << IOPRIO_CLASS_SHIFT | (class == IOPRIO_CLASS_IDLE ? 0 : level);
+        } else if (strcmp(args[0], "limit") == 0) {
+            args++;
+            while (args[0] != NULL && strchr(args[0], '=') != NULL) {
+                char *value = strchr(args[0], '=') + 1;
+                size_t nameLength = value - 1 - args[0];
+                int resource = -1;
+                for (size_t i = 0; i < sizeof(limitNames) / sizeof(limitNames[0]); i++) {
+                    if (strlen(limitNames[i].name) == nameLength
+                            && strncmp(limitNames[i].name, args[0], nameLength) == 0) {
+                        resource = limitNames[i].resource;
+                    }
+                }
+                rlim_t limit;
+                if (resource < 0 || parseLimitValue(value, &limit) < 0) {
+                    fprintf(stderr, "limit: bad limit %s, use mem cpu nofile procs fsize stack or core=N[KMGT]\n", args[0]);
+                    return NULL;
+                }
+                if (settings->limitCount == MAX_LIMITS) {
+                    fprintf(stderr, "limit: too many limits\n");
+                    return NULL;
+                }
+                settings->limitResources[settings->limitCount] = resource;
+                settings->limitValues[settings->limitCount] = limit;
+                settings->limitCount++;
+                args++;
+            }
+        } else {
+            break;
+        }
+    }
+    if (args[0] == NULL) {
+        fprintf(stderr, "Missing command after pin, nice, ionice or limit\n");
+        return NULL;
+    }
+    return args;
+
+}
+
+// In the child, between fork and exec. A setting that cannot be applied
+// ends the child, the command does not run without it.
+void applyLaunchSettings(LaunchSettings *settings) {
+
+    if (settings->pinned && sched_setaffinity(0, sizeof(cpu_set_t), &settings->cpus) < 0) {
+        perror("pin");
+        exit(126);
+    }
+    if (settings->niceSet) {
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, current + settings->niceIncrement) < 0) {
+            perror("nice");
+            exit(126);
+        }
+    }
+    if (settings->ioPriority >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, settings->ioPriority) < 0) {
+        perror("ionice");
+        exit(126);
+    }
+    for (int i = 0; i < settings->limitCount; i++) {
+        struct rlimit limit = { settings->limitValues[i], settings->limitValues[i] };
+        if (setrlimit(settings->limitResources[i], &limit) < 0) {
+            perror("limit");
+            exit(126);
+        }
+    }
+
+}
+
+// pin                 show the defaults
+// pin -f 0-1          run foreground jobs on CPUs 0-1 unless they say otherwise
+// pin -b 2-7          the same for jobs started with &
+// pin -f off, pin -b off
+int pinBuiltin(char *args[]) {
+
+    if (args[1] == NULL) {
+        printf("foreground: ");
+        if (foregroundDefaults.pinned) printCpuList(&foregroundDefaults.cpus);
+        else printf("any");
+        printf("\nbackground: ");
+        if (backgroundDefaults.pinned) printCpuList(&backgroundDefaults.cpus);
+        else printf("any");
+        printf("\n");
+        return 0;
+    }
+    if ((strcmp(args[1], "-f") != 0 && strcmp(args[1], "-b") != 0) || args[2] == NULL) {
+        fprintf(stderr, "Usage: pin <cpus> command | pin -f|-b <cpus>|off\n");
+        return 2;
+    }
+    LaunchSettings *defaults = args[1][1] == 'b' ? &backgroundDefaults : &foregroundDefaults;
+    if (strcmp(args[2], "off") == 0) {
+        defaults->pinned = 0;
+        return 0;
+    }
+    cpu_set_t cpus;
+    if (parseCpuList(args[2], &cpus) < 0) {
+        fprintf(stderr, "pin: bad CPU list: %s\n", args[2]);
+        return 1;
+    }
+    defaults->cpus = cpus;
+    defaults->pinned = 1;
+    return 0;
+
+}
+
+// Hand the terminal to a foreground job's group, or back to the shell
+void setTerminalOwner(pid_t pgid) {
+
+    if (terminalFd >= 0) {
+        tcsetpgrp(terminalFd, pgid);
+    }
+
+}
+
+// Wait for a foreground process. With the terminal handed over, ^z stops the
+// job instead of reaching our handler; it is terminated as ^z always did.
+pid_t waitForeground(pid_t pid, int *status) {
+
+    while (1) {
+        pid_t reaped = waitChild(pid, status, WUNTRACED);
+        if (reaped < 0 && errno == EINTR) continue;
+        if (reaped > 0 && WIFSTOPPED(*status)) {
+            if (foreground_pid > 0) terminateRunningProcess(SIGTSTP);
+            else kill(pid, SIGKILL);
+            continue;
+        }
+        return reaped;
+    }
+
+}
+
+// launch, launch spawn, launch fork
+int launchBuiltin(char *args[]) {
+
+    if (args[1] == NULL) {
+        printf("%s\n", launchMode == LAUNCH_SPAWN ? "spawn" : "fork");
+    } else if (strcmp(args[1], "spawn") == 0) {
+        launchMode = LAUNCH_SPAWN;
+    } else if (strcmp(args[1], "fork") == 0) {
+        launchMode = LAUNCH_FORK;
+    } else {
+        fprintf(stderr, "Usage: launch [spawn|fork]\n");
+        return 2;
+    }
+    return 0;
+
+}
+
+// Start a child for the command; the path is resolved in the parent so the
+// lookup is cached for the following commands.
+void launchCommand(char *args[], int background) {
+
+    fflush(stdout); // children share our stdout, keep the order of messages
+
+    // time covers the whole rest of the line, pipelines included
+    if (strcmp(args[0], "time") == 0) {
+        lastStatus = timeBuiltin(args);
+        return;
+    }
+
+    // pin/nice/ionice/limit in front hold for the whole job
+    LaunchSettings settings;
+    initLaunchSettings(&settings, background);
+    char **command = parseLaunchPrefixes(args, &settings);
+    if (command == NULL) {
+        lastStatus = 2;
+        return;
+    }
+    launchSettings = hasLaunchSettings(&settings) ? &settings : NULL;
+    giveTerminal = !background;
+    launchJob(command, background, command != args);
+    launchSettings = NULL;
+    giveTerminal = 0;
+
+}
+
+// Every job gets a process group of its own; a foreground one also gets the
+// terminal until it is done. forkBuiltins: builtins run in a child too, so
+// the launch settings do not change the shell itself.
+void launchJob(char *args[], int background, int forkBuiltins) {
+
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] == pipeToken) {
+            launchPipeline(args, background);
+            return;
+        }
+    }
+
+    // Builtins run right here; with & they get a child like a pipeline stage,
+    // so a background cd or umask does not change the shell
+    Builtin *builtin = builtinFor(args);
+    if (builtin != NULL && !builtin->forks && !forkBuiltins && !background) {
+        runBuiltin(builtin, args);
+        return;
+    }
+
+    pid_t pid;
+    if (builtin != NULL) {
+        pid = forkBuiltin(args, -1, -1, 0, NULL, 0);
+    } else {
+        char *path = findCommand(args[0]);
+        if (path == NULL) {
+            fprintf(stderr, "Command not found: %s\n", args[0]);
+            lastStatus = 127;
+            return;
+        }
+        if (launchMode == LAUNCH_SPAWN) {
+            pid = spawnCommand(path, args, -1, -1, -1, 0);
+        } else {
+            pid = forkCommand(path, args, -1, -1, -1, 0);
+        }
+    }
+    if (pid < 0) {
+        lastStatus = 126;
+        return;
+    }
+
+    if (!background) {
+        int status = 0;
+        foreground_pid = pid;
+        setTerminalOwner(pid);
+        waitForeground(pid, &status);
+        setTerminalOwner(shellPgid);
+        foreground_pid = 0;
+        lastStatus = exitCode(status);
+    } else {
+        lastStatus = 0;
+        Job *job = addJob(&pid, 1, pid, joinArgs(args));
+        printf("[%d] Background process started with PID %d\n", job->id, pid);
+    }
+
+}
+
+// a | b | c: every stage is started before we wait for any of them, all in
+// one process group led by the first stage so ^Z reaches the whole pipeline.
+void launchPipeline(char *args[], int background) {
+
+    int stageCount = 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] == pipeToken) stageCount++;
+    }
+
+    char *command = background ? joinArgs(args) : NULL;
+    char ***stages = malloc(stageCount * sizeof(char **));
+    pid_t *pids = malloc(stageCount * sizeof(pid_t));
+    int *pipeFds = malloc(2 * (stageCount - 1) * sizeof(int));
+    int pipeFdCount = 0;
+
+    // Cut args into one NULL terminated argument list per stage
+    int stage = 0;
+    stages[0] = args;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i] == pipeToken) {
+            args[i] = NULL;
+            stages[++stage] = &args[i + 1];
+        }
+    }
+    for (int i = 0; i < stageCount; i++) {
+        if (stages[i][0] == NULL) {
+            fprintf(stderr, "Syntax error near |\n");
+            goto done;
+        }
+    }
+
+    // Close on exec so spawned stages only keep the ends dup'ed onto 0 and 1
+    for (int i = 0; i < stageCount - 1; i++) {
+        if (pipe2(&pipeFds[2 * i], O_CLOEXEC) < 0) {
+            perror("pipe failed");
+            goto done;
+        }
+        pipeFdCount += 2;
+        if (splicePipes) {
+            fcntl(pipeFds[2 * i], F_SETPIPE_SZ, PIPE_BUFFER_SIZE); // best effort, capped by pipe-max-size
+        }
+    }
+
+    pid_t pgid = 0;
+    LaunchSettings *jobSettings = launchSettings;
+    for (int i = 0; i < stageCount; i++) {
+        int inFd = i > 0 ? pipeFds[2 * (i - 1)] : -1;
+        int outFd = i < stageCount - 1 ? pipeFds[2 * i + 1] : -1;
+        pid_t pid = -1;
+
+        // a stage may have prefixes of its own on top of the job's
+        LaunchSettings stageSettings;
+        if (jobSettings != NULL) stageSettings = *jobSettings;
+        else initLaunchSettings(&stageSettings, background);
+        stages[i] = parseLaunchPrefixes(stages[i], &stageSettings);
+        launchSettings = hasLaunchSettings(&stageSettings) ? &stageSettings : NULL;
+
+        if (stages[i] == NULL) {
+            // the message is out, the other stages still get their pipe ends closed
+        } else if (builtinFor(stages[i]) != NULL) {
+            pid = forkBuiltin(stages[i], inFd, outFd, pgid, pipeFds, pipeFdCount);
+        } else {
+            char *path = findCommand(stages[i][0]);
+            if (path == NULL) {
+                fprintf(stderr, "Command not found: %s\n", stages[i][0]);
+            } else if (launchMode == LAUNCH_SPAWN) {
+                pid = spawnCommand(path, stages[i], inFd, outFd, -1, pgid);
+            } else {
+                pid = forkCommand(path, stages[i], inFd, outFd, -1, pgid);
+            }
+        }
+        pids[i] = pid;
+        if (pid > 0 && pgid == 0) pgid = pid;
+    }
+    launchSettings = jobSettings;
+
+    // The stages hold their own copies now; EOF/SIGPIPE only work once ours are gone
+    for (int i = 0; i < pipeFdCount; i++) {
+        close(pipeFds[i]);
+    }
+    pipeFdCount = 0;
+
+    if (!background) {
+        int status = 0;
+        foreground_pid = pgid;
+        if (pgid > 0) setTerminalOwner(pgid);
+        for (int i = 0; i < stageCount; i++) {
+            if (pids[i] > 0) waitForeground(pids[i], &status);
+        }
+        setTerminalOwner(shellPgid);
+        foreground_pid = 0;
+        lastStatus = pids[stageCount - 1] > 0 ? exitCode(status) : 127;
+    } else if (pgid > 0) {
+        Job *job = addJob(pids, stageCount, pgid, command);
+        command = NULL;
+        printf("[%d] Background process started with PID %d\n", job->id, pgid);
+    }
+
+done:
+    for (int i = 0; i < pipeFdCount; i++) {
+        close(pipeFds[i]);
+    }
+    free(command);
+    free(stages);
+    free(pids);
+    free(pipeFds);
+
+}
+
+// Builtins that get a process of their own: pipeline stages, and the copy
+// builtins which may run for a long time and have to stop on ^c and ^z.
+pid_t forkBuiltin(char *args[], int inFd, int outFd, pid_t pgid, int pipeFds[], int pipeFdCount) {
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return -1;
+    }
+    if (pid == 0) { // child process
+        sigprocmask(SIG_SETMASK, &originalSignalMask, NULL);
+        setpgid(0, pgid);
+        if (giveTerminal && terminalFd >= 0) tcsetpgrp(terminalFd, getpgrp());
+        signal(SIGTTOU, SIG_DFL);
+        if (launchSettings != NULL) applyLaunchSettings(launchSettings);
+        if (inFd >= 0) dup2(inFd, STDIN_FILENO);
+        if (outFd >= 0) dup2(outFd, STDOUT_FILENO);
+        for (int i = 0; i < pipeFdCount; i++) {
+            close(pipeFds[i]);
+        }
+        handleRedirection(args);
+        exit(findBuiltin(args[0])->function(args));
+    }
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    trackProcess(pid, args[0]);
+    return pid;
+
+}
+
+// Move everything from inFd to outFd, keeping the data in the kernel when it
+// can: copy_file_range() between regular files (no page cache copy at all on
+// filesystems that share extents), sendfile() from a regular file, splice()
+// when one end is a pipe. Each one falls through to the next when the kernel
+// refuses the pair (other filesystem, O_APPEND output, ...), then read/write.
+// All of them use and advance the file offsets, so switching midway is fine.
+int copyFd(int inFd, int outFd) {
+
+    int method = COPY_FILE_RANGE;
+    char *buffer = NULL;
+    struct stat inStat;
+
+    if (fstat(inFd, &inStat) == 0 && S_ISREG(inStat.st_mode)) {
+        posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    } else {
+        method = COPY_SPLICE; // the first two need a file to read from
+    }
+
+    while (1) {
+        ssize_t n;
+        if (method == COPY_FILE_RANGE) {
+            n = copy_file_range(inFd, NULL, outFd, NULL, KERNEL_COPY_SIZE, 0);
+        } else if (method == COPY_SENDFILE) {
+            n = sendfile(outFd, inFd, NULL, KERNEL_COPY_SIZE);
+        } else if (method == COPY_SPLICE) {
+            n = splice(inFd, NULL, outFd, NULL, PIPE_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            if (buffer == NULL) buffer = malloc(COPY_BUFFER_SIZE);
+            n = read(inFd, buffer, COPY_BUFFER_SIZE);
+            if (n > 0 && writeAll(outFd, buffer, n) < 0) n = -1;
+        }
+        if (n < 0 && method != COPY_READ_WRITE && (errno == EINVAL || errno == EXDEV
+                || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            method++;
+            continue;
+        }
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+    return 0;
+
+}
+
+// write() all of data, also when the kernel takes it in parts
+int writeAll(int fd, const char *data, size_t length) {
+
+    for (size_t written = 0; written < length; ) {
+        ssize_t w = write(fd, data + written, length - written);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += w;
+    }
+    return 0;
+
+}
+
+// Copy inFd to outFd and every file in fileFds. With pipes on both sides and
+// one file, tee() duplicates the data for outFd and splice() then drains the
+// same bytes into the file. splice() refuses O_APPEND files (tee -a), those
+// and any other refusal go to read/write; bytes tee() already passed on are
+// read back from the pipe for the file first.
+int teeFd(int inFd, int outFd, int fileFds[], int fileCount) {
+
+    int useTee = fileCount == 1 && (fcntl(fileFds[0], F_GETFL) & O_APPEND) == 0;
+    char *buffer = NULL;
+
+    while (1) {
+        ssize_t n;
+        if (useTee) {
+            n = tee(inFd, outFd, PIPE_BUFFER_SIZE, 0);
+            if (n < 0 && errno == EINVAL) {
+                useTee = 0;
+                continue;
+            }
+            ssize_t moved = 0;
+            while (n > 0 && moved < n) {
+                ssize_t m = splice(inFd, NULL, fileFds[0], NULL, n - moved, SPLICE_F_MOVE);
+                if (m < 0 && errno == EINTR) continue;
+                if (m <= 0) break;
+                moved += m;
+            }
+            if (n > 0 && moved < n) {
+                useTee = 0;
+                if (buffer == NULL) buffer = malloc(COPY_BUFFER_SIZE);
+                while (moved < n) {
+                    ssize_t r = read(inFd, buffer, n - moved < COPY_BUFFER_SIZE ? n - moved : COPY_BUFFER_SIZE);
+                    if (r < 0 && errno == EINTR) continue;
+                    if (r <= 0 || writeAll(fileFds[0], buffer, r) < 0) {
+                        n = -1;
+                        break;
+                    }
+                    moved += r;
+                }
+            }
+        } else {
+            if (buffer == NULL) buffer = malloc(COPY_BUFFER_SIZE);
+            n = read(inFd, buffer, COPY_BUFFER_SIZE);
+            if (n > 0 && writeAll(outFd, buffer, n) < 0) {
+                n = -1;
+            }
+            for (int i = 0; n > 0 && i < fileCount; i++) {
+                if (writeAll(fileFds[i], buffer, n) < 0) n = -1;
+            }
+        }
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+    return 0;
+
+}
+
+// cat [file...], - is stdin
+int catBuiltin(char *args[]) {
+
+    int status = 0;
+    struct stat outStat;
+    int outIsFile = fstat(STDOUT_FILENO, &outStat) == 0 && S_ISREG(outStat.st_mode);
+    char *stdinArgs[] = { args[0], "-", NULL };
+
+    if (args[1] == NULL) {
+        args = stdinArgs;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        int fd = strcmp(args[i], "-") == 0 ? STDIN_FILENO : open(args[i], O_RDONLY);
+        if (fd < 0) {
+            perror(args[i]);
+            status = 1;
+            continue;
+        }
+        struct stat inStat;
+        if (outIsFile && fstat(fd, &inStat) == 0 && inStat.st_dev == outStat.st_dev
+                && inStat.st_ino == outStat.st_ino) {
+            fprintf(stderr, "cat: %s: input file is output file\n", args[i]);
+            status = 1;
+        } else if (copyFd(fd, STDOUT_FILENO) < 0) {
+            perror("cat");
+            status = 1;
+        }
+        if (fd != STDIN_FILENO) close(fd);
+    }
+    return status;
+
+}
+
+// Copy one file; a new destination gets the source's permissions
+int copyFile(const char *from, const char *to) {
+
+    int inFd = open(from, O_RDONLY);
+    if (inFd < 0) {
+        perror(from);
+        return 1;
+    }
+    struct stat inStat, outStat;
+    fstat(inFd, &inStat);
+    if (S_ISDIR(inStat.st_mode)) {
+        fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", from);
+        close(inFd);
+        return 1;
+    }
+    if (stat(to, &outStat) == 0 && inStat.st_dev == outStat.st_dev && inStat.st_ino == outStat.st_ino) {
+        fprintf(stderr, "cp: '%s' and '%s' are the same file\n", from, to);
+        close(inFd);
+        return 1;
+    }
+
+    int outFd = open(to, O_WRONLY | O_CREAT | O_TRUNC, inStat.st_mode & 0777);
+    if (outFd < 0) {
+        perror(to);
+        close(inFd);
+        return 1;
+    }
+    int status = 0;
+    if (copyFd(inFd, outFd) < 0) {
+        perror("cp");
+        status = 1;
+    }
+    close(inFd);
+    if (close(outFd) < 0) {
+        perror(to);
+        status = 1;
+    }
+    return status;
+
+}
+
+// cp source dest, cp source... dir
+int cpBuiltin(char *args[]) {
+
+    int count = 0;
+    while (args[count + 1] != NULL) count++;
+    if (count < 2) {
+        fprintf(stderr, "Usage: cp <source> <dest> | cp <source>... <dir>\n");
+        return 2;
+    }
+
+    char *target = args[count];
+    struct stat targetStat;
+    int toDir = stat(target, &targetStat) == 0 && S_ISDIR(targetStat.st_mode);
+    if (!toDir) {
+        if (count > 2) {
+            fprintf(stderr, "cp: target '%s' is not a directory\n", target);
+            return 1;
+        }
+        return copyFile(args[1], target);
+    }
+
+    int status = 0;
+    for (int i = 1; i < count; i++) {
+        const char *name = strrchr(args[i], '/');
+        name = name != NULL ? name + 1 : args[i];
+        char *path = malloc(strlen(target) + strlen(name) + 2);
+        sprintf(path, "%s/%s", target, name);
+        status |= copyFile(args[i], path);
+        free(path);
+    }
+    return status;
+
+}
+
+// tee [-a] [file...]
+int teeBuiltin(char *args[]) {
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int first = 1;
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        first = 2;
+    }
+
+    int count = 0;
+    while (args[first + count] != NULL) count++;
+    int *fds = malloc((count + 1) * sizeof(int));
+    int fileCount = 0;
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        int fd = open(args[first + i], flags, 0644);
+        if (fd < 0) {
+            perror(args[first + i]);
+            status = 1;
+            continue;
+        }
+        fds[fileCount++] = fd;
+    }
+
+    if (fileCount == 0 ? copyFd(STDIN_FILENO, STDOUT_FILENO) < 0
+            : teeFd(STDIN_FILENO, STDOUT_FILENO, fds, fileCount) < 0) {
+        perror("tee");
+        status = 1;
+    }
+    for (int i = 0; i < fileCount; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+    return status;
+
+}
+
+// pipes, pipes copy, pipes splice
+int pipesBuiltin(char *args[]) {
+
+    if (args[1] == NULL) {
+        printf("%s\n", splicePipes ? "splice" : "copy");
+    } else if (strcmp(args[1], "splice") == 0) {
+        splicePipes = 1;
+    } else if (strcmp(args[1], "copy") == 0) {
+        splicePipes = 0;
+    } else {
+        fprintf(stderr, "Usage: pipes [copy|splice]\n");
+        return 2;
+    }
+    return 0;
+
+}
+
+// Shell style exit status from a waitpid() status
+int exitCode(int status) {
+
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+
+}
+
+// Descriptor a redirection operator replaces, -1 for other arguments. A file
+// is opened with *flags, except for 2>&1 and >&2 where *sourceFd is copied.
+int redirectionTarget(const char *operator, int *flags, int *sourceFd) {
+
+    *sourceFd = -1;
+    if (operator == outputToken) {
+        *flags = O_WRONLY | O_CREAT | O_TRUNC;
+        return STDOUT_FILENO;
+    }
+    if (operator == appendToken) {
+        *flags = O_WRONLY | O_CREAT | O_APPEND;
+        return STDOUT_FILENO;
+    }
+    if (operator == inputToken) {
+        *flags = O_RDONLY;
+        return STDIN_FILENO;
+    }
+    if (operator == errorToken) {
+        *flags = O_WRONLY | O_CREAT | O_TRUNC;
+        return STDERR_FILENO;
+    }
+    if (operator == errorAppendToken) {
+        *flags = O_WRONLY | O_CREAT | O_APPEND;
+        return STDERR_FILENO;
+    }
+    if (operator == errorToOutputToken) {
+        *sourceFd = STDOUT_FILENO;
+        return STDERR_FILENO;
+    }
+    if (operator == outputToErrorToken) {
+        *sourceFd = STDERR_FILENO;
+        return STDOUT_FILENO;
+    }
+    return -1;
+
+}
+
+// handleRedirection() for builtins: there is no child to throw away, so the
+// shell's own descriptors are saved first and put back by restoreRedirections().
+int applyRedirections(char *args[], int savedFds[3]) {
+
+    savedFds[0] = savedFds[1] = savedFds[2] = -1;
+
+    for (int i = 0; args[i] != NULL; i++) {
+        int flags, sourceFd;
+        int targetFd = redirectionTarget(args[i], &flags, &sourceFd);
+        if (targetFd < 0) continue;
+
+        if (sourceFd >= 0) {
+            fflush(targetFd == STDOUT_FILENO ? stdout : stderr);
+            if (savedFds[targetFd] < 0) {
+                savedFds[targetFd] = fcntl(targetFd, F_DUPFD_CLOEXEC, 10);
+            }
+            dup2(sourceFd, targetFd);
+            args[i] = NULL;
+            continue;
+        }
+        if (args[i + 1] == NULL) {
+            fprintf(stderr, "Missing file name after %s\n", args[i]);
+            restoreRedirections(savedFds);
+            return -1;
+        }
+        int fd = open(args[i + 1], flags, 0644);
+        if (fd < 0) {
+            perror(args[i + 1]);
+            restoreRedirections(savedFds);
+            return -1;
+        }
+        fflush(stdout); // what was printed so far belongs to the old stdout
+        if (savedFds[targetFd] < 0) {
+            savedFds[targetFd] = fcntl(targetFd, F_DUPFD_CLOEXEC, 10);
+        }
+        dup2(fd, targetFd);
+        close(fd);
+        args[i] = NULL;
+    }
+    return 0;
+
+}
+
+void restoreRedirections(int savedFds[3]) {
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++) {
+        if (savedFds[fd] >= 0) {
+            dup2(savedFds[fd], fd);
+            close(savedFds[fd]);
+            savedFds[fd] = -1;
+        }
+    }
+
+}
+
+Builtin builtins[] = {
+    { "cd", cdBuiltin, 0, NULL },
+    { "pwd", pwdBuiltin, 0, NULL },
+    { "echo", echoBuiltin, 0, NULL },
+    { "export", exportBuiltin, 0, NULL },
+    { "test", testBuiltin, 0, NULL },
+    { "[", testBuiltin, 0, NULL },
+    { "true", trueBuiltin, 0, NULL },
+    { "false", falseBuiltin, 0, NULL },
+    { "hash", hashBuiltin, 0, NULL },
+    { "launch", launchBuiltin, 0, NULL },
+    { "pipes", pipesBuiltin, 0, NULL },
+    { "jobs", jobsBuiltin, 0, NULL },
+    { "wait", waitBuiltin, 0, NULL },
+    { "kill", killBuiltin, 0, NULL },
+    { "parallel", parallelBuiltin, 0, NULL },
+    { "stats", statsBuiltin, 0, NULL },
+    { "cat", catBuiltin, 1, "" },
+    { "cp", cpBuiltin, 1, "" },
+    { "tee", teeBuiltin, 1, "a" },
+    { "pin", pinBuiltin, 0, NULL },
+};
+
+Builtin *findBuiltin(const char *name) {
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+
+}
+
+// The builtin that runs args, or NULL for an external command. cat, cp and
+// tee only know a few options, cat -n or cp -r go to /bin/cat and /bin/cp.
+Builtin *builtinFor(char *args[]) {
+
+    Builtin *builtin = findBuiltin(args[0]);
+    if (builtin == NULL || builtin->options == NULL) {
+        return builtin;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') continue; // - is stdin
+        if (i > 1 || args[i][2] != '\0' || strchr(builtin->options, args[i][1]) == NULL) {
+            return NULL;
+        }
+    }
+    return builtin;
+
+}
+
+void runBuiltin(Builtin *builtin, char *args[]) {
+
+    int savedFds[3];
+
+    if (applyRedirections(args, savedFds) < 0) {
+        lastStatus = 1;
+        return;
+    }
+    lastStatus = builtin->function(args);
+    restoreRedirections(savedFds);
+
+}
+
+// cd [dir], cd - goes back to $OLDPWD
+int cdBuiltin(char *args[]) {
+
+    char *dir = args[1];
+    char cwd[PATH_MAX];
+
+    if (dir == NULL) {
+        dir = getenv("HOME");
+        if (dir == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    } else if (strcmp(dir, "-") == 0) {
+        dir = getenv("OLDPWD");
+        if (dir == NULL) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        printf("%s\n", dir);
+    }
+
+    char *oldDir = getcwd(cwd, sizeof(cwd)) != NULL ? strdup(cwd) : NULL;
+    if (chdir(dir) < 0) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        free(oldDir);
+        return 1;
+    }
+    if (oldDir != NULL) setenv("OLDPWD", oldDir, 1);
+    if (getcwd(cwd, sizeof(cwd)) != NULL) setenv("PWD", cwd, 1);
+    free(oldDir);
+    return 0;
+
+}
+
+int pwdBuiltin(char *args[]) {
+
+    char cwd[PATH_MAX];
+
+    (void)args;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+
+}
+
+// echo [-n] args...
+int echoBuiltin(char *args[]) {
+
+    int i = 1;
+    int newline = 1;
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) putchar(' ');
+        fputs(args[i], stdout);
+    }
+    if (newline) putchar('\n');
+    return ferror(stdout) ? 1 : 0;
+
+}
+
+// export, export NAME=VALUE...
+int exportBuiltin(char *args[]) {
+
+    int status = 0;
+
+    if (args[1] == NULL) {
+        for (char **env = environ; *env != NULL; env++) {
+            printf("export %s\n", *env);
+        }
+        return 0;
+    }
 
+    for (int i = 1; args[i] != NULL; i++) {
+        char *equals = strchr(args[i], '=');
+        size_t nameLength = equals != NULL ? (size_t)(equals - args[i]) : strlen(args[i]);
+        int valid = nameLength > 0 && !isdigit((unsigned char)args[i][0]);
+        for (size_t c = 0; c < nameLength; c++) {
+            if (!isalnum((unsigned char)args[i][c]) && args[i][c] != '_') valid = 0;
+        }
+        if (!valid) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        if (equals == NULL) {
+            continue; // every variable we know of is already in the environment
+        }
+        *equals = '\0';
+        setenv(args[i], equals + 1, 1);
+        *equals = '=';
+    }
+    return status;
 
-/* The setup function below will not return any value, but it will just: read
-in the next command line; separate it into distinct arguments (using blanks as
-delimiters), and set the args array entries to point to the beginning of what
-will become null-terminated, C-style strings. */
+}
 
-void setup(char inputBuffer[], char *args[], int *background) {
-    int length, /* # of characters in the command line */
-        i,      /* loop index for accessing inputBuffer array */
-        start,  /* index where beginning of next command parameter is */
-        ct;     /* index of where to place the next parameter into args[] */
+// The test expression in args[0..count-1]: 0 true, 1 false, 2 error
+int evaluateTest(char *args[], int count) {
 
-    ct = 0;
+    struct stat st;
 
-    /* read what the user enters on the command line */
-    
-    if (isFromHistory == 1) {
-        length = strlen(inputBuffer) + 1;  // Use the string length directly
-    } 
-    else {
-        length = read(STDIN_FILENO, inputBuffer, MAX_LINE);
+    if (count == 0) {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0) {
+        int status = evaluateTest(args + 1, count - 1);
+        return status == 2 ? 2 : !status;
+    }
+    if (count == 1) {
+        return args[0][0] != '\0' ? 0 : 1;
     }
-    
-    /* 0 is the system predefined file descriptor for stdin (standard input),
-       which is the user's screen in this case. inputBuffer by itself is the
-       same as &inputBuffer[0], i.e. the starting address of where to store
-       the command that is read, and length holds the number of characters
-       read in. inputBuffer is not a null terminated C-string. */
 
-    if (length == 0){
-        exit(0);  /* ^d was entered, end of user command stream */
+    if (count == 2) {
+        const char *op = args[0];
+        const char *arg = args[1];
+        if (strcmp(op, "-n") == 0) return arg[0] != '\0' ? 0 : 1;
+        if (strcmp(op, "-z") == 0) return arg[0] == '\0' ? 0 : 1;
+        if (strcmp(op, "-e") == 0) return stat(arg, &st) == 0 ? 0 : 1;
+        if (strcmp(op, "-f") == 0) return stat(arg, &st) == 0 && S_ISREG(st.st_mode) ? 0 : 1;
+        if (strcmp(op, "-d") == 0) return stat(arg, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : 1;
+        if (strcmp(op, "-s") == 0) return stat(arg, &st) == 0 && st.st_size > 0 ? 0 : 1;
+        if (strcmp(op, "-L") == 0) return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+        if (strcmp(op, "-r") == 0) return access(arg, R_OK) == 0 ? 0 : 1;
+        if (strcmp(op, "-w") == 0) return access(arg, W_OK) == 0 ? 0 : 1;
+        if (strcmp(op, "-x") == 0) return access(arg, X_OK) == 0 ? 0 : 1;
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
     }
 
-    /* the signal interrupted the read system call */
-    /* if the process is in the read() system call, read returns -1
-    However, if this occurs, errno is set to EINTR. We can check this  value
-    and disregard the -1 value */
+    if (count == 3) {
+        const char *left = args[0];
+        const char *op = args[1];
+        const char *right = args[2];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0 ? 0 : 1;
+        if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0 ? 0 : 1;
 
-    if ((length < 0) && (errno != EINTR)) {
-        perror("Error reading command");
-        exit(-1);  /* terminate with error code of -1 */
+        char *end1, *end2;
+        long a = strtol(left, &end1, 10);
+        long b = strtol(right, &end2, 10);
+        if (op[0] == '-' && (*left == '\0' || *end1 != '\0' || *right == '\0' || *end2 != '\0')) {
+            fprintf(stderr, "test: integer expression expected\n");
+            return 2;
+        }
+        if (strcmp(op, "-eq") == 0) return a == b ? 0 : 1;
+        if (strcmp(op, "-ne") == 0) return a != b ? 0 : 1;
+        if (strcmp(op, "-lt") == 0) return a < b ? 0 : 1;
+        if (strcmp(op, "-le") == 0) return a <= b ? 0 : 1;
+        if (strcmp(op, "-gt") == 0) return a > b ? 0 : 1;
+        if (strcmp(op, "-ge") == 0) return a >= b ? 0 : 1;
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
     }
 
-    start = -1;
-    *background = 0;
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
 
-    for (i = 0; i < length; i++) { /* examine every character in the inputBuffer */
-        if((i + 1 == length)  && (inputBuffer[i] != '\n')){
-            if (start != -1) {
-            args[ct] = &inputBuffer[start];
-            ct++;
-            }
-        inputBuffer[i] = '\0';
-        args[ct] = NULL; 
-        continue;
-        }
-        switch (inputBuffer[i]) {
-            case ' ':
-            case '\t':                                  /* argument separators */
-                if (start != -1) {
-                    args[ct] = &inputBuffer[start];     /* set up pointer */
-                    ct++;
-                }
-                inputBuffer[i] = '\0';                  /* add a null char; make a C string */
-                start = -1;
-                break;
-            case '\n':                                  /* should be the final char examined */
-                if (start != -1) {
-                    args[ct] = &inputBuffer[start];
-                    ct++;
-                }
-                inputBuffer[i] = '\0';
-                args[ct] = NULL;                        /* no more arguments to this command */
-                break;
-            default:                                    /* some other character */
-                if (start == -1) start = i;
+}
 
-                if (inputBuffer[i] == '&') {
-                    *background = 1;
-                    inputBuffer[i] = '\0';
-                }
-        }  /* end of switch */
+// test expr, [ expr ]
+int testBuiltin(char *args[]) {
+
+    int count = 0;
+    while (args[count + 1] != NULL) count++;
+
+    if (strcmp(args[0], "[") == 0) {
+        if (count == 0 || strcmp(args[count], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        count--;
     }
-    args[ct] = NULL;  /* just in case the input line was > 80 */
-    //for (i = 0; i <= ct; i++)
-		//printf("args %d = %s\n",i,args[i]);
-} /* end of setup routine */
+    return evaluateTest(&args[1], count);
 
+}
 
-int countWords(const char *buffer) {
+int trueBuiltin(char *args[]) {
 
-    int inWord = 0;
-    int wordCount = 0;
+    (void)args;
+    return 0;
 
-    while (*buffer != '\0') {
-        if (isspace((unsigned char)*buffer)) {
-            inWord = 0;
-        } else if (!inWord) {
-            inWord = 1;
-            wordCount++;
+}
+
+int falseBuiltin(char *args[]) {
+
+    (void)args;
+    return 1;
+
+}
+
+double secondsSince(struct timespec *start) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+
+}
+
+// The command for one input: every {} is replaced by it, and without any {}
+// the input becomes the last argument. Only the changed arguments are copied.
+char **parallelCommand(char *command[], const char *input) {
+
+    int count = 0;
+    int placeholders = 0;
+    while (command[count] != NULL) {
+        if (strstr(command[count], PLACEHOLDER) != NULL) placeholders++;
+        count++;
+    }
+
+    char **argv = malloc((count + 2) * sizeof(char *));
+    size_t inputLength = strlen(input);
+    for (int i = 0; i < count; i++) {
+        char *found = strstr(command[i], PLACEHOLDER);
+        if (found == NULL) {
+            argv[i] = command[i];
+            continue;
         }
-        buffer++; // Move to the next character
+        size_t length = strlen(command[i]);
+        char *arg = malloc(length + (length / 2 + 1) * inputLength + 1);
+        char *end = arg;
+        const char *from = command[i];
+        for (; found != NULL; found = strstr(from, PLACEHOLDER)) {
+            memcpy(end, from, found - from);
+            end += found - from;
+            memcpy(end, input, inputLength);
+            end += inputLength;
+            from = found + strlen(PLACEHOLDER);
+        }
+        strcpy(end, from);
+        argv[i] = arg;
     }
-    return wordCount;
+    if (placeholders == 0) {
+        argv[count++] = (char *)input;
+    }
+    argv[count] = NULL;
+    return argv;
 
 }
 
-void addToHistory(char *args[]) {
+// Same launch path as launchCommand(), with stdout/stderr going to the task's
+// capture files. Builtins are forked so they can run next to each other.
+pid_t startParallelTask(char *command[], const char *input, int outFd, int errFd) {
 
-    char command[MAX_LINE] = ""; 
-    int i = 0;
+    char **argv = parallelCommand(command, input);
+    pid_t pid = -1;
 
-    while (args[i] != NULL) {
-        strcat(command, args[i]);
-        strcat(command, " "); 
-        i++;
+    Builtin *builtin = builtinFor(argv);
+    if (builtin != NULL) {
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) { // child process
+            sigprocmask(SIG_SETMASK, &originalSignalMask, NULL);
+            dup2(outFd, STDOUT_FILENO);
+            dup2(errFd, STDERR_FILENO);
+            handleRedirection(argv);
+            exit(builtin->function(argv));
+        }
+        if (pid < 0) perror("Fork failed");
+        else trackProcess(pid, argv[0]);
+    } else {
+        char *path = findCommand(argv[0]);
+        if (path == NULL) {
+            dprintf(errFd, "Command not found: %s\n", argv[0]);
+        } else if (launchMode == LAUNCH_SPAWN) {
+            pid = spawnCommand(path, argv, -1, outFd, errFd, -1);
+        } else {
+            pid = forkCommand(path, argv, -1, outFd, errFd, -1);
+        }
     }
 
-    if (strlen(command) > 0) {
-        command[strlen(command) - 1] = '\0';
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (argv[i] != command[i] && argv[i] != input) free(argv[i]);
     }
+    free(argv);
+    return pid;
 
-    strncpy(history[history_count % HISTORY_SIZE], command, MAX_LINE - 1);
+}
+
+// Anonymous file for a task's captured output: a memfd, or an unlinked file
+// in /tmp where memfd_create() is missing or out of memory. -1 when neither works.
+int captureFile(const char *name) {
 
-    history[history_count % HISTORY_SIZE][MAX_LINE - 1] = '\0'; 
-    history_count++;
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0) {
+        char path[] = "/tmp/myshell-parallel-XXXXXX";
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd >= 0) unlink(path);
+    }
+    return fd;
 
 }
 
-void addToHistoryForHistoryCommand(char args[]) {
+// Print the task's output as one block and free its slot
+void finishParallelTask(ParallelTask *task, int status, int exitCodes[], double times[]) {
 
-    if (args == NULL || strlen(args) == 0) {
-        return;
-    }
+    times[task->input] = secondsSince(&task->start);
+    exitCodes[task->input] = exitCode(status);
 
-    strncpy(history[history_count % HISTORY_SIZE], args, MAX_LINE - 1);
+    fflush(stdout);
+    lseek(task->outFd, 0, SEEK_SET);
+    copyFd(task->outFd, STDOUT_FILENO);
+    lseek(task->errFd, 0, SEEK_SET);
+    copyFd(task->errFd, STDERR_FILENO);
+    close(task->outFd);
+    close(task->errFd);
+    task->pid = 0;
 
-    history[history_count % HISTORY_SIZE][MAX_LINE - 1] = '\0';
-    history_count++;
 }
 
+// parallel [-j N] cmd [args with {}] ::: input...
+// parallel [-j N] cmd [args with {}]          (one input per line of stdin)
+// Keeps N commands running, starts the next one as soon as one ends, prints
+// each command's output in one piece and a summary on stderr.
+int parallelBuiltin(char *args[]) {
 
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int a = 1;
 
-void printHistory() {
+    if (args[a] != NULL && strncmp(args[a], "-j", 2) == 0) {
+        char *value = args[a][2] != '\0' ? &args[a][2] : args[++a];
+        slots = value != NULL ? atol(value) : 0;
+        if (slots <= 0) {
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            return 2;
+        }
+        a++;
+    }
+    if (args[a] == NULL || strcmp(args[a], ":::") == 0) {
+        fprintf(stderr, "Usage: parallel [-j N] command [args with {}] [::: inputs...]\n");
+        return 2;
+    }
 
-    int start;
-    int end = history_count;
-    
-    if(history_count > HISTORY_SIZE){
-        start = history_count - HISTORY_SIZE;
+    char **command = &args[a];
+    char **inputs;
+    int inputCount = 0;
+    int fromStdin = 0;
+    LineReader stdinReader = { STDIN_FILENO, NULL, 0, 0, 0, 0 };
+
+    while (args[a] != NULL && strcmp(args[a], ":::") != 0) a++;
+    if (args[a] != NULL) {
+        args[a] = NULL; // ends the command
+        inputs = &args[a + 1];
+        while (inputs[inputCount] != NULL) inputCount++;
+    } else {
+        int capacity = 64;
+        size_t length;
+        char *line;
+        inputs = malloc(capacity * sizeof(char *));
+        fromStdin = 1;
+        while ((line = readLine(&stdinReader, &length)) != NULL) {
+            if (inputCount == capacity) {
+                capacity *= 2;
+                inputs = realloc(inputs, capacity * sizeof(char *));
+            }
+            inputs[inputCount++] = strdup(line);
+        }
+        free(stdinReader.buffer);
     }
-    else{
-        start = 0;
+
+    if (slots > inputCount) slots = inputCount;
+    ParallelTask *tasks = calloc(slots > 0 ? slots : 1, sizeof(ParallelTask));
+    int *exitCodes = malloc((inputCount + 1) * sizeof(int));
+    double *times = malloc((inputCount + 1) * sizeof(double));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int next = 0;
+    int running = 0;
+    while (next < inputCount || running > 0) {
+        // Fill every free slot
+        for (int t = 0; t < slots && next < inputCount; t++) {
+            if (tasks[t].pid != 0) continue;
+            ParallelTask *task = &tasks[t];
+            task->input = next++;
+            task->outFd = captureFile("parallel-out");
+            task->errFd = captureFile("parallel-err");
+            clock_gettime(CLOCK_MONOTONIC, &task->start);
+            if (task->outFd < 0 || task->errFd < 0) {
+                // Nowhere to keep its output, the task fails instead of writing to a wrong fd
+                perror("parallel: cannot capture output");
+                if (task->outFd >= 0) close(task->outFd);
+                if (task->errFd >= 0) close(task->errFd);
+                exitCodes[task->input] = 126;
+                times[task->input] = 0;
+                continue;
+            }
+            task->pid = startParallelTask(command, inputs[task->input], task->outFd, task->errFd);
+            if (task->pid < 0) {
+                finishParallelTask(task, 127 << 8, exitCodes, times);
+                continue;
+            }
+            running++;
+        }
+        if (running == 0) continue;
+
+        int status;
+        pid_t pid = waitChild(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("parallel");
+            break;
+        }
+        int found = 0;
+        for (int t = 0; t < slots; t++) {
+            if (tasks[t].pid == pid) {
+                finishParallelTask(&tasks[t], status, exitCodes, times);
+                running--;
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            markProcessDone(pid, status); // a background job ended meanwhile
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < inputCount; i++) {
+        if (exitCodes[i] != 0) failed++;
+    }
+    fflush(stdout);
+    fprintf(stderr, "parallel: %d jobs, %d failed, %.3fs wall\n", inputCount, failed, secondsSince(&start));
+    for (int i = 0; i < inputCount; i++) {
+        fprintf(stderr, "%6d  exit %-3d %8.3fs  %s\n", i + 1, exitCodes[i], times[i], inputs[i]);
     }
 
-    for (int i = history_count - 1; i >= start; i--) {
-        printf("%d %s\n", end - i - 1, history[i % HISTORY_SIZE]);
+    if (fromStdin) {
+        for (int i = 0; i < inputCount; i++) free(inputs[i]);
+        free(inputs);
     }
+    free(tasks);
+    free(exitCodes);
+    free(times);
+    return failed > 0 ? 1 : 0;
+
+}
+
+// Remember when a child started and which command it runs
+void trackProcess(pid_t pid, const char *command) {
+
+    TrackedProcess *process = malloc(sizeof(TrackedProcess));
+    const char *slash = strrchr(command, '/');
+    process->pid = pid;
+    process->name = strdup(slash != NULL ? slash + 1 : command);
+    clock_gettime(CLOCK_MONOTONIC, &process->start);
+    process->next = trackedProcesses[pid % PROCESS_TABLE_SIZE];
+    trackedProcesses[pid % PROCESS_TABLE_SIZE] = process;
 
 }
 
-void historyCommand(int index, char inputBuffer[], char *args[], int *background) {
+// waitpid() for every place the shell reaps children. wait4() hands us the
+// child's resource usage, which is charged to its command name.
+pid_t waitChild(pid_t pid, int *status, int options) {
 
-    int start;
-    int end = history_count;
-    isFromHistory = 1;
+    struct rusage usage;
+    pid_t reaped = wait4(pid, status, options, &usage);
+    if (reaped <= 0 || !(WIFEXITED(*status) || WIFSIGNALED(*status))) {
+        return reaped;
+    }
 
-    if(history_count > HISTORY_SIZE){
-        start = history_count - HISTORY_SIZE;
+    if (timing) {
+        timedUsage.ru_utime.tv_sec += usage.ru_utime.tv_sec;
+        timedUsage.ru_utime.tv_usec += usage.ru_utime.tv_usec;
+        timedUsage.ru_stime.tv_sec += usage.ru_stime.tv_sec;
+        timedUsage.ru_stime.tv_usec += usage.ru_stime.tv_usec;
+        if (usage.ru_maxrss > timedUsage.ru_maxrss) timedUsage.ru_maxrss = usage.ru_maxrss;
+        timedUsage.ru_nvcsw += usage.ru_nvcsw;
+        timedUsage.ru_nivcsw += usage.ru_nivcsw;
     }
-    else{
-        start = 0;
+
+    TrackedProcess **link = &trackedProcesses[reaped % PROCESS_TABLE_SIZE];
+    while (*link != NULL) {
+        TrackedProcess *process = *link;
+        if (process->pid == reaped) {
+            recordCommandStats(process->name, secondsSince(&process->start), &usage);
+            *link = process->next;
+            free(process->name);
+            free(process);
+            break;
+        }
+        link = &process->next;
     }
+    return reaped;
 
-    int command_Index = history_count - 1 - index;
+}
 
-    if (command_Index < start || command_Index >= end) {
-        fprintf(stderr, "Invalid history index.\n");
-        return;
+void recordCommandStats(const char *name, double wallTime, struct rusage *usage) {
+
+    unsigned int bucket = hashCommandName(name);
+    CommandStats *stats = commandStats[bucket];
+    while (stats != NULL && strcmp(stats->name, name) != 0) {
+        stats = stats->next;
+    }
+    if (stats == NULL) {
+        stats = calloc(1, sizeof(CommandStats));
+        stats->name = strdup(name);
+        stats->next = commandStats[bucket];
+        commandStats[bucket] = stats;
     }
 
-    // Retrieve the command from history
-    
+    if (stats->runs == stats->capacity) {
+        stats->capacity = stats->capacity == 0 ? 16 : stats->capacity * 2;
+        stats->wallTimes = realloc(stats->wallTimes, stats->capacity * sizeof(double));
+    }
+    stats->wallTimes[stats->runs++] = wallTime;
+    if (usage != NULL) {
+        stats->userTime += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+        stats->systemTime += usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+        if (usage->ru_maxrss > stats->maxRss) stats->maxRss = usage->ru_maxrss;
+        stats->voluntarySwitches += usage->ru_nvcsw;
+        stats->involuntarySwitches += usage->ru_nivcsw;
+    }
+
+}
 
-    char *command = history[command_Index % HISTORY_SIZE];
-    printf("Executing command from history: %s\n", command);
+int compareDoubles(const void *a, const void *b) {
 
-    strncpy(inputBuffer, command, MAX_LINE - 1);
-    inputBuffer[MAX_LINE - 1] = '\0';
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
 
-    addToHistoryForHistoryCommand(command);
+}
 
-    setup(inputBuffer, args, background);
+// Nearest rank percentile of an ascending array
+double percentile(double sorted[], int count, double p) {
 
-    isFromHistory = 0;
+    int rank = (int)(p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("Fork failed");
-        return;
+}
+
+int compareStatsByWall(const void *a, const void *b) {
+
+    const CommandStats *x = *(CommandStats * const *)a;
+    const CommandStats *y = *(CommandStats * const *)b;
+    double wallX = 0, wallY = 0;
+    for (int i = 0; i < x->runs; i++) wallX += x->wallTimes[i];
+    for (int i = 0; i < y->runs; i++) wallY += y->wallTimes[i];
+    return (wallX < wallY) - (wallX > wallY);
+
+}
+
+// Every command name we have stats for, most total wall time first.
+// The wall times of each one are sorted as a side effect.
+CommandStats **sortedCommandStats(int *count) {
+
+    int n = 0;
+    for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+        for (CommandStats *stats = commandStats[i]; stats != NULL; stats = stats->next) n++;
     }
-    if (pid == 0) { // Child process
-        handleRedirection(args);
-        char *pathEnv = getenv("PATH");
-        if (!pathEnv) {
-            fprintf(stderr, "PATH not set\n");
-            exit(1);
-        }
-        char *pathDir = strtok(pathEnv, ":");
-        while (pathDir) {
-            snprintf(commandPath, sizeof(commandPath), "%s/%s", pathDir, args[0]);
-            if (access(commandPath, X_OK) == 0) {
-                execv(commandPath, args);
-                perror("execv failed");
-                exit(1);
-            }
-            pathDir = strtok(NULL, ":");
-        }
-        fprintf(stderr, "Command not found: %s\n", args[0]);
-        exit(1);
-    } else { // Parent process
-        if (!*background) {
-            waitpid(pid, NULL, 0);
-        } else {
-            printf("Background process started with PID %d\n", pid);
+    CommandStats **list = malloc((n + 1) * sizeof(CommandStats *));
+    n = 0;
+    for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+        for (CommandStats *stats = commandStats[i]; stats != NULL; stats = stats->next) {
+            qsort(stats->wallTimes, stats->runs, sizeof(double), compareDoubles);
+            list[n++] = stats;
         }
     }
+    qsort(list, n, sizeof(CommandStats *), compareStatsByWall);
+    *count = n;
+    return list;
 
 }
 
+void writeStatsJson(FILE *file) {
 
-// fg %num
-void moveBackgroundToForeground(int pid) {
+    int count;
+    CommandStats **list = sortedCommandStats(&count);
 
-    for (int i = 0; i < background_count; i++) {
-        if (background_pids[i] == pid) {
-            foreground_pid = pid;  // Set as the foreground process
-            waitpid(pid, NULL, 0);  // Wait for the process to finish
-            foreground_pid = 0;  // Reset the foreground PID
-            background_count--;
-            background_pids[i] = background_pids[background_count];  // Remove from background list
-            return;
+    fprintf(file, "{\"commands\": [");
+    for (int i = 0; i < count; i++) {
+        CommandStats *stats = list[i];
+        double total = 0;
+        for (int r = 0; r < stats->runs; r++) total += stats->wallTimes[r];
+
+        fprintf(file, "%s\n  {\"name\": \"", i > 0 ? "," : "");
+        for (const char *c = stats->name; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+            else if ((unsigned char)*c < 0x20) fprintf(file, "\\u%04x", *c);
+            else fputc(*c, file);
         }
+        fprintf(file, "\", \"runs\": %d, \"wall_total\": %.6f, \"wall_p50\": %.6f, \"wall_p95\": %.6f, "
+            "\"wall_p99\": %.6f, \"user\": %.6f, \"sys\": %.6f, \"max_rss_kb\": %ld, "
+            "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld}",
+            stats->runs, total, percentile(stats->wallTimes, stats->runs, 50),
+            percentile(stats->wallTimes, stats->runs, 95), percentile(stats->wallTimes, stats->runs, 99),
+            stats->userTime, stats->systemTime, stats->maxRss,
+            stats->voluntarySwitches, stats->involuntarySwitches);
     }
-    fprintf(stderr, "No such background process.\n");
+    fprintf(file, "\n]}\n");
+    free(list);
 
 }
 
+// atexit() handler, writes the session's stats to $MYSHELL_STATS. Forked
+// builtins and failed launches inherit it and exit() too, they must not
+// overwrite the shell's file with their copy of the counters.
+void dumpStatsOnExit() {
 
-void exitRequest() {
-
-    if (background_count > 0) {
-        printf("There are %d background processes running.\n", background_count);
-        for (int i = 0; i < background_count; i++) {
-            printf("PID: %d\n", background_pids[i]);
-        }
-        printf("Do you want to terminate all background processes and exit? (y/n): ");
-        char choice = getchar();
-        if (choice == 'y' || choice == 'Y') {
-            for (int i = 0; i < background_count; i++) {
-                kill(background_pids[i], SIGKILL);
-            }
-            background_count = 0;
-            exit(0);
-        }
+    if (getpid() != statsPid) {
         return;
     }
-    else{
-        exit(0);
+    char *path = getenv("MYSHELL_STATS");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return;
     }
+    writeStatsJson(file);
+    fclose(file);
 
 }
 
+// time cmd...: wall time of the command plus the CPU, memory and context
+// switches of the children it needed, on stderr like bash's time.
+int timeBuiltin(char *args[]) {
 
-void handleRedirection(char *args[]) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "Usage: time command [args...]\n");
+        return 2;
+    }
 
-    int i = 0;
+    struct timespec start;
+    struct rusage selfBefore, selfAfter;
+    int outerTiming = timing;
+    struct rusage outerUsage = timedUsage;
 
-    while (args[i] != NULL) {
+    memset(&timedUsage, 0, sizeof(timedUsage));
+    timing = 1;
+    getrusage(RUSAGE_SELF, &selfBefore);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-        if (strcmp(args[i], ">") == 0) {
-            int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("Error opening file for output redirection");
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            args[i] = NULL;
-        } 
-        else if (strcmp(args[i], ">>") == 0) {
-            int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (fd < 0) {
-                perror("Error opening file for output append");
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            args[i] = NULL;
-        } 
-        else if (strcmp(args[i], "<") == 0) {
-            int fd = open(args[i + 1], O_RDONLY);
-            if (fd < 0) {
-                perror("Error opening file for input redirection");
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-            args[i] = NULL;
-        } 
-        else if (strcmp(args[i], "2>") == 0) {
-            int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("Error opening file for error redirection");
-                exit(1);
+    launchCommand(&args[1], 0);
+
+    double wall = secondsSince(&start);
+    getrusage(RUSAGE_SELF, &selfAfter);
+    timing = outerTiming;
+
+    // builtins run in the shell itself, so our own usage counts too
+    double user = timedUsage.ru_utime.tv_sec + timedUsage.ru_utime.tv_usec / 1e6
+        + (selfAfter.ru_utime.tv_sec - selfBefore.ru_utime.tv_sec)
+        + (selfAfter.ru_utime.tv_usec - selfBefore.ru_utime.tv_usec) / 1e6;
+    double sys = timedUsage.ru_stime.tv_sec + timedUsage.ru_stime.tv_usec / 1e6
+        + (selfAfter.ru_stime.tv_sec - selfBefore.ru_stime.tv_sec)
+        + (selfAfter.ru_stime.tv_usec - selfBefore.ru_stime.tv_usec) / 1e6;
+
+    fflush(stdout);
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+        (int)(wall / 60), wall - 60 * (int)(wall / 60),
+        (int)(user / 60), user - 60 * (int)(user / 60),
+        (int)(sys / 60), sys - 60 * (int)(sys / 60));
+    fprintf(stderr, "maxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+        timedUsage.ru_maxrss, timedUsage.ru_nvcsw, timedUsage.ru_nivcsw);
+
+    if (outerTiming) {
+        // an enclosing time also counts what we just measured
+        outerUsage.ru_utime.tv_sec += timedUsage.ru_utime.tv_sec;
+        outerUsage.ru_utime.tv_usec += timedUsage.ru_utime.tv_usec;
+        outerUsage.ru_stime.tv_sec += timedUsage.ru_stime.tv_sec;
+        outerUsage.ru_stime.tv_usec += timedUsage.ru_stime.tv_usec;
+        if (timedUsage.ru_maxrss > outerUsage.ru_maxrss) outerUsage.ru_maxrss = timedUsage.ru_maxrss;
+        outerUsage.ru_nvcsw += timedUsage.ru_nvcsw;
+        outerUsage.ru_nivcsw += timedUsage.ru_nivcsw;
+    }
+    timedUsage = outerUsage;
+    return lastStatus;
+
+}
+
+// stats, stats -j (JSON), stats -r (reset)
+int statsBuiltin(char *args[]) {
+
+    if (args[1] != NULL && strcmp(args[1], "-j") == 0) {
+        writeStatsJson(stdout);
+        return 0;
+    }
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+            CommandStats *stats = commandStats[i];
+            while (stats != NULL) {
+                CommandStats *next = stats->next;
+                free(stats->name);
+                free(stats->wallTimes);
+                free(stats);
+                stats = next;
             }
-            dup2(fd, STDERR_FILENO);
-            close(fd);
-            args[i] = NULL;
+            commandStats[i] = NULL;
         }
+        return 0;
+    }
+    if (args[1] != NULL) {
+        fprintf(stderr, "Usage: stats [-j | -r]\n");
+        return 2;
+    }
 
-        i++;
+    int count;
+    CommandStats **list = sortedCommandStats(&count);
+    printf("%-20s %6s %10s %10s %10s %10s %10s %10s\n",
+        "command", "runs", "p50", "p95", "p99", "wall", "cpu", "maxrss");
+    for (int i = 0; i < count; i++) {
+        CommandStats *stats = list[i];
+        double total = 0;
+        for (int r = 0; r < stats->runs; r++) total += stats->wallTimes[r];
+        printf("%-20s %6d %9.3fs %9.3fs %9.3fs %9.3fs %9.3fs %8ldKB\n",
+            stats->name, stats->runs, percentile(stats->wallTimes, stats->runs, 50),
+            percentile(stats->wallTimes, stats->runs, 95), percentile(stats->wallTimes, stats->runs, 99),
+            total, stats->userTime + stats->systemTime, stats->maxRss);
     }
-    
+    free(list);
+    return 0;
+
+}
+
+//^c, pass it on to a foreground pipeline's process group
+void interruptForeground(int signum) {
+
+    (void)signum;
+    if (foreground_pid > 0) {
+        kill(-foreground_pid, SIGINT);
+    } else {
+        signal(SIGINT, SIG_DFL); // nothing running, ^c ends the shell as before
+        raise(SIGINT);
+    }
+
 }
 
 //^z
 void terminateRunningProcess(int signum) {
 
+    (void)signum;
     if (foreground_pid > 0) {
         // Send SIGKILL to the process group
         kill(-foreground_pid, SIGKILL);  // Negative PID sends to the process group
@@ -370,22 +4315,159 @@ void terminateRunningProcess(int signum) {
 }
 
 
-int main(void) {
+int isListOperator(const char *arg) {
+
+    return arg == semicolonToken || arg == andToken || arg == orToken || arg == backgroundToken;
+
+}
+
+// Runs the commands of a line one after the other. && and || look at
+// lastStatus, ; just goes on and & starts the command before it in the
+// background (only that pipeline, not the whole && || chain).
+void runCommandList(char *args[], int background) {
+
+    char *previous = NULL; // operator in front of the current command
+    int i = 0;
+
+    while (args[i] != NULL) {
+        int j = i;
+        while (args[j] != NULL && !isListOperator(args[j])) j++;
+        char *operator = args[j];
+
+        if (j == i || (operator != NULL && operator != semicolonToken
+                && operator != backgroundToken && args[j + 1] == NULL)) {
+            fprintf(stderr, "Syntax error near %s\n", operator != NULL ? operator : "end of line");
+            lastStatus = 2;
+            return;
+        }
+        args[j] = NULL;
+
+        int run = previous == NULL || previous == semicolonToken || previous == backgroundToken
+            || (previous == andToken && lastStatus == 0) || (previous == orToken && lastStatus != 0);
+        // Collect background jobs that finished, -c lines and scripts never
+        // wait for input so this is the only place they are reaped
+        reapChildren();
+        if (run && runCommand(&args[i], operator == backgroundToken || (operator == NULL && background)) < 0) {
+            return;
+        }
+
+        if (operator == NULL) break;
+        previous = operator;
+        i = j + 1;
+    }
+
+}
+
+// One command of a list: the builtins that need main()'s state, then
+// everything else through launchCommand(). Returns -1 when the rest of the
+// line must not run, the input it came from may be gone.
+int runCommand(char *args[], int background) {
+
+    args = expandArgs(args);
+    if (args[0] == NULL) {
+        return 0; // only substitutions that printed nothing, lastStatus is theirs
+    }
+    if (strcmp(args[0], "history") == 0) {
+        lastStatus = 0;
+        if (args[1] && strcmp(args[1], "-i") == 0) {
+            if (args[2]) {
+                int index = atoi(args[2]);
+                historyCommand(index);
+            } else {
+                fprintf(stderr, "Usage: history -i <index>\n");
+                lastStatus = 2;
+            }
+        } else if (args[1] && (strcmp(args[1], "-s") == 0 || strcmp(args[1], "-g") == 0)) {
+            if (args[2]) {
+                char *query = joinArgs(&args[2]);
+                searchHistory(query, args[1][1] == 's');
+                free(query);
+            } else {
+                fprintf(stderr, "Usage: history -s <prefix> | history -g <text>\n");
+                lastStatus = 2;
+            }
+        } else {
+            printHistory();
+        }
+    } else if (strcmp(args[0], "exit") == 0) {
+        exitRequest(args); // reads the answer from the same input as the line
+        return -1;
+    } else if (strcmp(args[0], "fg") == 0) {
+        if (args[1] && args[1][0] == '%') {
+            int number = atoi(&args[1][1]);
+            moveBackgroundToForeground(number);
+        } else {
+            fprintf(stderr, "Usage: fg %%<job>\n");
+            lastStatus = 2;
+        }
+    } else {
+        launchCommand(args, background);
+    }
+    return 0;
+
+}
+
+
+// myshell            interactive, commands from stdin
+// myshell -c "cmd"   run cmd (may hold several lines) and exit
+// myshell script.sh  run the commands in the file and exit
+int main(int argc, char *argv[]) {
 
-    char inputBuffer[MAX_LINE];    /*buffer to hold command entered */
+    char *inputBuffer = NULL;    /*command line entered, owned by setup() */
     int background; /* equals 1 if a command is followed by '&' */
-    char *args[MAX_LINE / 2 + 1]; /*command line arguments */
-    
+    char **args = NULL; /*command line arguments, grown by setup() */
+
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        interactive = 0;
+        inputReader.fd = -1;
+        inputReader.end = strlen(argv[2]);
+        inputReader.capacity = inputReader.end + 1;
+        inputReader.buffer = malloc(inputReader.capacity);
+        memcpy(inputReader.buffer, argv[2], inputReader.capacity);
+    } else if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "Usage: %s [-c command | script]\n", argv[0]);
+        exit(2);
+    } else if (argc > 1) {
+        interactive = 0;
+        inputReader.fd = open(argv[1], O_RDONLY);
+        if (inputReader.fd < 0) {
+            perror(argv[1]);
+            exit(127);
+        }
+    }
+
     signal(SIGTSTP, terminateRunningProcess);
+    signal(SIGINT, interruptForeground);
+
+    // Finished children are noticed through a signalfd polled next to stdin
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, &originalSignalMask);
+    signalFd = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    // Job control: foreground jobs get the terminal, we take it back after
+    if (interactive && isatty(STDIN_FILENO)) {
+        terminalFd = STDIN_FILENO;
+        shellPgid = getpgrp();
+        signal(SIGTTOU, SIG_IGN);
+    }
+
+    openHistory();
+    statsPid = getpid();
+    atexit(dumpStatsOnExit);
 
     while (1) {
 
         background = 0;
-        printf("myshell> ");
-        fflush(stdout);
+        if (interactive) {
+            printJobNotices();
+            printf("myshell> ");
+            fflush(stdout);
+        }
 
         /*setup() calls exit() when Control-D is entered */
-        setup(inputBuffer, args, &background);
+        setup(&inputBuffer, &args, &background);
 
 
         /** the steps are:
@@ -399,70 +4481,10 @@ int main(void) {
 
         if (args[0] == NULL) continue;
         
-        if (args[0] != NULL && strcmp(args[0], "history") != 0) {
-        addToHistory(args);
-        }
-
-        if (strcmp(args[0], "history") == 0) {
-            if (args[1] && strcmp(args[1], "-i") == 0) {
-                if (args[2]) {
-                    int index = atoi(args[2]);
-                    historyCommand(index, inputBuffer, args, &background);
-                    
-                    continue;
-                } else {
-                    fprintf(stderr, "Usage: history -i <index>\n");
-                }
-            } else {
-                printHistory();
-            }
-            continue;
-        } else if (strcmp(args[0], "exit") == 0) {
-            exitRequest();
-            continue;
-        } else if (strcmp(args[0], "fg") == 0) {
-            if (args[1] && args[1][0] == '%') {
-                int pid = atoi(&args[1][1]);
-                moveBackgroundToForeground(pid);
-            } else {
-                fprintf(stderr, "Usage: fg %%<pid>\n");
-            }
-            continue;
+        if (strcmp(args[0], "history") != 0) {
+        addToHistory(lastLine);
         }
 
-        pid_t pid = fork();
-        if (pid < 0) { // child process
-            perror("Fork failed");
-            continue;
-        }
-        if (pid == 0) {
-            handleRedirection(args);
-            char *pathEnv = getenv("PATH");
-            if (!pathEnv) {
-                fprintf(stderr, "PATH not set\n");
-                exit(1);
-            }
-            char *pathDir = strtok(pathEnv, ":");
-            while (pathDir) {
-                snprintf(commandPath, sizeof(commandPath), "%s/%s", pathDir, args[0]);
-                if (access(commandPath, X_OK) == 0) {
-                    execv(commandPath, args);
-                    perror("execv failed");
-                    exit(1);
-                }
-                pathDir = strtok(NULL, ":");
-            }
-            fprintf(stderr, "Command not found: %s\n", args[0]);
-            exit(1);
-        } else { // parent process
-            if (!background) {
-                foreground_pid = pid;
-                waitpid(pid, NULL, 0);
-                foreground_pid = 0;
-            } else {
-                background_pids[background_count++] = pid;
-                printf("Background process started with PID %d\n", pid);
-            }
-        }
+        runCommandList(args, background);
     }
 }
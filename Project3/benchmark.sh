@@ -0,0 +1,173 @@
+#!/bin/bash
+#Throughput and scaling benchmark for project3's text pipeline. Generates
+#synthetic inputs, sweeps the worker count and the stage weights, and prints
+#one result per case as JSON (default) or CSV. The default chain runs fused in
+#the upper stage, so replace_mb_per_sec is null (empty in CSV) when the
+#replace stage had nothing to do.
+#Usage: ./benchmark.sh [project3 binary] [sizes in MB, comma separated] [max workers] [json|csv]
+#Build first: gcc -O2 -pthread -o project3 project3.c
+#Example for the full range: ./benchmark.sh ./project3 1,100,1000,10000 64 csv > results.csv
+
+binary="${1:-./project3}"
+sizes="${2:-1,64}"
+max_workers="${3:-$(nproc)}"
+format="${4:-json}"
+
+if [ ! -x "$binary" ]; then
+    echo "Cannot run $binary, build it with: gcc -O2 -pthread -o project3 project3.c" >&2
+    exit 1
+fi
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+profiles="short long skewed"
+weight_sets="1,1,1,1 4,4,4,1"
+
+#Worker counts to try: 1, 2, 4, ... up to max_workers, and max_workers itself
+worker_counts=""
+for (( w = 1; w < max_workers; w *= 2 )); do
+    worker_counts="$worker_counts $w"
+done
+worker_counts="$worker_counts $max_workers"
+
+#About 4 MiB of lines for a profile, always the same (fixed seed):
+#short 8-40 bytes, long 1000-3000 bytes, skewed mostly 30 bytes with 1% of 64 KiB
+make_sample() {
+    awk -v profile="$1" 'BEGIN {
+        srand(42)
+        letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+        total = 0
+        while (total < 4194304) {
+            if (profile == "short") n = 8 + int(rand() * 33)
+            else if (profile == "long") n = 1000 + int(rand() * 2001)
+            else n = rand() < 0.01 ? 65536 : 30
+            line = ""
+            while (length(line) < n) {
+                word = ""
+                for (i = 2 + int(rand() * 8); i > 0; i--) word = word substr(letters, 1 + int(rand() * 62), 1)
+                line = line word " "
+            }
+            line = substr(line, 1, n)
+            print line
+            total += n + 1
+        }
+    }'
+}
+
+#Input of a profile and size: its sample repeated, cut at size bytes
+make_input() {
+    local sample="$work_dir/sample_$1"
+    [ -f "$sample" ] || make_sample "$1" > "$sample"
+    while :; do cat "$sample" || break; done 2>/dev/null | head -c "$2" > "$3"
+}
+
+#Run one case 3 times, keep the trace of the fastest; prints its wall nanoseconds
+run_case() {
+    local input="$1" workers="$2" weights="$3"
+    local start end best=0
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        "$binary" -d "$input" -n ${weights//,/ } -j "$workers" -o "$work_dir/output" --trace=json > "$work_dir/trace.json"
+        end=$(date +%s%N)
+        if [ "$best" -eq 0 ] || [ $(( end - start )) -lt "$best" ]; then
+            best=$(( end - start ))
+            mv "$work_dir/trace.json" "$work_dir/best.json"
+        fi
+    done
+    echo "$best"
+}
+
+#From a JSON trace: busy time of every stage, the run's counters, and the
+#latency of every chunk (read start to write end) with its line count
+#Prints: read_ns upper_ns replace_ns write_ns max_rss_kb voluntary involuntary replace_steps
+summarize_trace() {
+    awk -F'[":, {}]+' -v latencies="$work_dir/latencies" '
+        /"replace_steps"/ { steps = $3 }
+        /"max_rss_kb"/ { rss = $3 }
+        /"voluntary_context_switches"/ { voluntary = $3 }
+        /"involuntary_context_switches"/ { involuntary = $3 }
+        /"stage"/ {
+            stage = $3; first = $7; lines = $9; start = $11; end = $13
+            busy[stage] += end - start
+            if (stage == "read") read_start[first] = start
+            if (stage == "write") { write_end[first] = end; chunk_lines[first] = lines }
+        }
+        END {
+            for (first in write_end) print write_end[first] - read_start[first], chunk_lines[first] > latencies
+            printf "%d %d %d %d %d %d %d %d\n", busy["read"], busy["upper"], busy["replace"], busy["write"], rss, voluntary, involuntary, steps
+        }' "$1"
+}
+
+#p99 of the per-line latency in microseconds, each chunk counts once per line
+p99_latency_us() {
+    sort -n "$work_dir/latencies" | awk '
+        { latency[NR] = $1; lines[NR] = $2; total += $2 }
+        END {
+            seen = 0
+            for (i = 1; i <= NR; i++) {
+                seen += lines[i]
+                if (seen >= total * 0.99) { printf "%.1f", latency[i] / 1000; exit }
+            }
+            printf "0"
+        }'
+}
+
+#a / b with 3 decimals
+divide() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", (b > 0 ? a / b : 0) }'
+}
+
+columns="profile,size_mb,workers,weights,wall_ms,mb_per_sec,lines_per_sec,read_mb_per_sec,upper_mb_per_sec,replace_mb_per_sec,write_mb_per_sec,p99_line_latency_us,max_rss_kb,voluntary_context_switches,involuntary_context_switches"
+if [ "$format" = "csv" ]; then
+    echo "$columns"
+else
+    echo "["
+fi
+
+separator=""
+for profile in $profiles; do
+    for size_mb in ${sizes//,/ }; do
+        input="$work_dir/input.txt"
+        make_input "$profile" $(( size_mb * 1000000 )) "$input"
+        bytes=$(stat -c %s "$input")
+        lines=$(wc -l < "$input")
+        for weights in $weight_sets; do
+            for workers in $worker_counts; do
+                wall_ns=$(run_case "$input" "$workers" "$weights")
+                read -r read_ns upper_ns replace_ns write_ns rss voluntary involuntary replace_steps < <(summarize_trace "$work_dir/best.json")
+                replace_rate=$(divide "$(( bytes * 1000 ))" "$replace_ns")
+                if [ "$replace_steps" -eq 0 ]; then
+                    replace_rate=$([ "$format" = "csv" ] || echo null)
+                fi
+                #Stage rates are per busy worker second, end to end rates per wall second
+                values=("$profile" "$size_mb" "$workers" "\"${weights//,/ }\""
+                    "$(divide "$wall_ns" 1000000)"
+                    "$(divide "$(( bytes * 1000 ))" "$wall_ns")"
+                    "$(divide "$(( lines * 1000000 ))" "$(( wall_ns / 1000 ))")"
+                    "$(divide "$(( bytes * 1000 ))" "$read_ns")"
+                    "$(divide "$(( bytes * 1000 ))" "$upper_ns")"
+                    "$replace_rate"
+                    "$(divide "$(( bytes * 1000 ))" "$write_ns")"
+                    "$(p99_latency_us)" "$rss" "$voluntary" "$involuntary")
+                if [ "$format" = "csv" ]; then
+                    (IFS=,; echo "${values[*]}")
+                else
+                    IFS=, read -r -a names <<< "$columns"
+                    printf '%s  {' "$separator"
+                    for i in "${!names[@]}"; do
+                        value="${values[$i]}"
+                        [ "$i" -eq 0 ] && value="\"$value\""
+                        printf '%s"%s": %s' "$([ "$i" -gt 0 ] && echo ', ')" "${names[$i]}" "$value"
+                    done
+                    printf '}'
+                    separator=$',\n'
+                fi
+            done
+        done
+    done
+done
+
+if [ "$format" != "csv" ]; then
+    printf '\n]\n'
+fi
@@ -3,215 +3,2187 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#define HAVE_IO_URING 1
+#endif
 
-#define MAX_LINES 100
-#define MAX_LINE_LENGTH 1000
+#define CHUNK_LINES 256 // Lines that go through the stages together
+#define QUEUE_CAPACITY 64 // Chunks on their way through the stages at most, a power of two
+#define CLAIM_CHUNKS 4 // New chunks a worker takes at once, the rest can be stolen
+#define IDLE_SPINS 64 // Looks for work before an idle worker sleeps
+#define STAGE_READ 0 // Stages, a task is a chunk and the stage it is at next
+#define STAGE_UPPER 1
+#define STAGE_REPLACE 2
+#define STAGE_WRITE 3
+#define STAGE_COUNT 4
+#define TRACE_RING_SIZE 4096 // Events a worker may be ahead of the drainer, a power of two
+#define TRACE_DRAIN_INTERVAL 1000000 // Nanoseconds between the drainer's rounds
+#define TRACE_OFF 0 // --trace modes
+#define TRACE_TABLE 1
+#define TRACE_JSON 2
+#define BENCH_BUFFER_SIZE (16 * 1024 * 1024) // Text the kernel benchmark runs over
+#define STREAM_WINDOWS 8 // Windows a stream cycles through, at most QUEUE_CAPACITY
+#define STREAM_WINDOW_SIZE (1024 * 1024) // Bytes of a window, more only for a longer line
+#define MAX_CHAIN_STEPS 32 // Steps a -t chain may have
+#define TRANSFORM_MAP 0 // Kinds of transform steps
+#define TRANSFORM_TRIM 1
+#define TRANSFORM_FILTER 2
+#define MAP_NONE 0 // Kernels the upper stage may run its table with
+#define MAP_UPPER 1
+#define MAP_REPLACE 2
+#define MAP_UPPER_REPLACE 3
+#define MAP_TABLE 4
+#define BATCH_DEPTH 32 // Files a batch thread has in flight at once with io_uring
+#define BATCH_RING_ENTRIES 128 // Submission slots of a batch thread's ring, 3 per file at most
+#define BATCH_OPEN 0 // Phases of a batch file, each waits for all its operations
+#define BATCH_READ 1
+#define BATCH_WRITE 2
+#define BATCH_CLOSE 3
+#define BATCH_OP_OPEN_INPUT 0 // Operations, a completion's user_data is slot * 8 + operation
+#define BATCH_OP_STATX 1
+#define BATCH_OP_OPEN_OUTPUT 2
+#define BATCH_OP_READ 3
+#define BATCH_OP_WRITE 4
+#define BATCH_OP_CLOSE 5
+
+// One slot of a ChunkQueue, its sequence number says whose turn it is
+typedef struct QueueCell {
+    atomic_size_t sequence;
+    size_t chunk;
+} QueueCell;
+
+// One implementation of the text kernels. They work on a span of length
+// bytes, newlines included, so a whole chunk is done in one call.
+typedef struct Kernels {
+    const char *name;
+    void (*upper)(char *data, size_t length);
+    void (*replace)(char *data, size_t length, char from, char to);
+    void (*upperReplace)(char *data, size_t length, char from, char to); // both in one pass
+} Kernels;
+
+// Bounded multi-producer multi-consumer ring of chunk numbers. Producers
+// and consumers each advance their own counter with a compare-and-swap and
+// never take a lock. Holds the tasks of a stage that had all the workers it
+// may have when they came up.
+typedef struct ChunkQueue {
+    QueueCell cells[QUEUE_CAPACITY];
+    _Alignas(64) atomic_size_t head; // next cell to pop
+    _Alignas(64) atomic_size_t tail; // next cell to push
+} ChunkQueue;
+
+// Work-stealing deque of tasks (Chase-Lev). The owner pushes and pops at the
+// bottom, so it carries on with the chunk it just worked on while that is in
+// its cache; other workers steal the oldest task from the top. A task is
+// chunk * STAGE_COUNT + stage. Only chunks in flight have a task, so the
+// deque never holds more than QUEUE_CAPACITY.
+typedef struct WorkDeque {
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    _Atomic int64_t tasks[QUEUE_CAPACITY];
+} WorkDeque;
+
+// One stage run on one chunk, as the trace keeps it
+typedef struct TraceEvent {
+    uint64_t start; // nanoseconds since the run started
+    uint64_t end;
+    uint64_t firstLine;
+    uint32_t lineCount;
+    uint16_t worker;
+    uint8_t stage;
+} TraceEvent;
+
+// Events of one worker on their way to the drainer. Single producer, single
+// consumer: the worker only moves head and the drainer only moves tail, so
+// recording an event is two stores and no lock.
+typedef struct TraceRing {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+// One step of a transform chain. A line step is run on every line by the
+// replace stage; a map step between two line steps holds the composed table
+// of the maps there.
+typedef struct LineStep {
+    int kind;
+    unsigned char table[256]; // TRANSFORM_MAP
+    const char *pattern; // TRANSFORM_FILTER, a line stays when it contains it
+    size_t patternLength;
+} LineStep;
+
+// Where a chunk goes in the output when line steps changed its length
+typedef struct ChunkOutput {
+    size_t offset; // set once every chunk before it is placed
+    size_t length; // bytes left after the line steps
+    int newline; // the last line had no newline and was kept, it gets one
+    int ready; // the line steps are done
+} ChunkOutput;
+
+// A block of whole lines from a stream on its way through the stages. The
+// reader fills it, the pool transforms it in place and the writer puts it
+// out, then it is reused for a later block.
+typedef struct Window {
+    char *data;
+    size_t length; // bytes of whole lines, the last newline included
+    size_t capacity;
+    size_t firstLine;
+    size_t lineCount;
+    sem_t transformed; // posted when upper and replace are done
+} Window;
+
+#ifdef HAVE_IO_URING
+// An io_uring set up and driven with the raw syscalls: the submission and
+// completion rings are shared with the kernel, the heads and tails are
+// moved with acquire/release like the queues above.
+typedef struct Uring {
+    int fd;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t ringsSize;
+    size_t sqesSize;
+    unsigned toSubmit; // filled since the last io_uring_enter()
+} Uring;
+
+// One input file of a batch on its way to its output
+typedef struct BatchFile {
+    size_t input; // index in batchInputs
+    char *outputPath;
+    int inputFd;
+    int outputFd;
+    struct statx stat;
+    char *data;
+    size_t size;
+    size_t done; // bytes read or written so far
+    int phase;
+    int waiting; // operations of the phase still in flight
+    int failed;
+} BatchFile;
+#endif
+
+// A pool thread and what it keeps between tasks
+typedef struct Worker {
+    WorkDeque deque;
+    int number;
+    unsigned int seed; // picks the first worker to steal from
+    TraceRing *trace;  // NULL with --trace=off
+    pthread_t thread;
+} Worker;
 
 // Global variables
-char lines[MAX_LINES][MAX_LINE_LENGTH]; // Array to store file lines
-int totalLines = 0; // Total number of lines in the file
-int currentReadIndex = 0; // Index tracker for read threads
+char *input = NULL; // The input file, mapped copy-on-write so lines are changed in place
+size_t inputSize = 0;
+size_t *lineOffsets = NULL; // Start of every line, one more entry marks the end of the last
+size_t totalLines = 0; // Total number of lines in the file
+atomic_size_t totalChunks = 0; // not known until the end of a stream
+const char *fileName = NULL;
+const char *outputName = "output.txt";
 
-pthread_mutex_t read_mutex; // Mutex for read thread synchronization
-pthread_mutex_t process_mutex; // Mutex for processing and write thread synchronization
+Kernels *kernels; // the fastest set this CPU runs, see selectKernels()
 
-// Function to read a line from the file
-void *readThreads(void *arg) {
-    pthread_mutex_lock(&read_mutex); // Ensure to only one thread reads
+// The transform chain, see parseChain()
+const char *transformChain = "upper,replace: =_";
+LineStep chainSteps[MAX_CHAIN_STEPS]; // as given, for the trace table
+int chainStepCount = 0;
+unsigned char mapTable[256]; // the maps before the first line step, composed
+int mapKernel = MAP_NONE;
+char mapFrom, mapTo; // the replaced byte for MAP_REPLACE and MAP_UPPER_REPLACE
+LineStep lineSteps[2 * MAX_CHAIN_STEPS];
+int lineStepCount = 0;
+// With line steps a file's chunks shrink, so a chunk's output offset is the
+// sum of the lengths before it and chunks are placed in order
+ChunkOutput *chunkOutputs = NULL;
+pthread_mutex_t place_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t placedChunks = 0;
+size_t placedBytes = 0;
 
-    // ***IF YOU PLAN TO USE A DIFFERENT NAMED INPUT TEXT FILE, PLEASE INSERT FROM HERE!*** 
-    // Default is deneme.txt
-    FILE *file = fopen("deneme.txt", "r");
-    if (file == NULL) {
-        printf("Error: File not found or cannot be opened.\n");
-        pthread_mutex_unlock(&read_mutex); // Unlock before exit
-        pthread_exit(NULL);
+// The worker pool. Every chunk goes read -> upper -> replace -> write in
+// order, different chunks are at different stages at the same time.
+Worker *workers = NULL;
+int workerCount = 0;
+int stageLimits[STAGE_COUNT]; // most workers in a stage at once, from the -n weights
+atomic_int stageActive[STAGE_COUNT];
+ChunkQueue parkedTasks[STAGE_COUNT];
+atomic_size_t currentReadChunk = 0; // next chunk to start
+atomic_size_t chunksInFlight = 0; // started and not written yet, at most QUEUE_CAPACITY
+atomic_size_t chunksFinished = 0;
+atomic_int idleWorkers = 0;
+pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER; // idle workers sleep on idle_cond
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+int outputFd = -1; // written at known offsets, by any number of workers at once
+
+// Streaming, with -d - or -o -: the input is read in windows and written in
+// order as it comes, in constant memory. The read and write stages are the
+// main thread and a writer thread, the pool does the transforms.
+int streaming = 0;
+int inputFd = -1;
+Window windows[STREAM_WINDOWS]; // chunk c is in windows[c % STREAM_WINDOWS]
+sem_t freeWindows;
+int stageThreadCount = 0; // the streaming reader and writer, after the pool in workers
+
+// Batch mode, with a directory, a glob or an @list after -d: every input is
+// transformed whole into a file of the same name in the output directory
+int batch = 0;
+char **batchInputs = NULL;
+size_t batchCount = 0;
+const char *batchOutputDir = NULL;
+atomic_size_t nextBatchInput = 0;
+atomic_size_t batchBytes = 0;
+atomic_size_t batchLines = 0;
+atomic_int batchFailures = 0;
+int useUring = 1; // --no-uring uses the pread/pwrite threads only
+atomic_int uringThreads = 0; // batch threads that got a ring
+
+// Tracing: workers fill their rings, the drainer thread collects the events
+// here and they are rendered after the run
+int traceMode = -1; // a table, or nothing when streaming, unless --trace says
+FILE *traceFile = NULL; // stdout, or stderr when the output goes there
+size_t tracePrinted = 0;
+struct timespec runStart;
+TraceEvent *traceEvents = NULL;
+size_t traceEventCount = 0;
+size_t traceEventCapacity = 0;
+atomic_int traceStop = 0;
+const char *stageNames[STAGE_COUNT] = { "read", "upper", "replace", "write" };
+
+// Line index's text and length, without the newline
+static inline char *lineText(size_t index) {
+    return input + lineOffsets[index];
+}
+
+static inline size_t lineLength(size_t index) {
+    return lineOffsets[index + 1] - lineOffsets[index] - 1;
+}
+
+// Scalar kernels, for other CPUs and the tail of a span
+void upperScalar(char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] >= 'a' && data[i] <= 'z') {
+            data[i] -= 32;
+        }
+    }
+}
+
+void replaceScalar(char *data, size_t length, char from, char to) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == from) {
+            data[i] = to;
+        }
+    }
+}
+
+void upperReplaceScalar(char *data, size_t length, char from, char to) {
+    for (size_t i = 0; i < length; i++) {
+        char c = data[i] >= 'a' && data[i] <= 'z' ? data[i] - 32 : data[i];
+        data[i] = c == from ? to : c;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+/* Vector kernels. 'a'..'z' is found with one signed compare: adding
+128 - 'a' moves it to the 26 smallest signed bytes, then bit 0x20 is cleared
+where the mask is set. A replace flips x to "to" with x ^ (from ^ to) where
+x == from. The bytes after the last full vector go to the scalar kernel. */
+
+void upperSse2(char *data, size_t length) {
+    const __m128i shift = _mm_set1_epi8((char)(128 - 'a'));
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)(data + i));
+        __m128i lower = _mm_cmplt_epi8(_mm_add_epi8(x, shift), limit);
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(x, _mm_and_si128(lower, caseBit)));
+    }
+    upperScalar(data + i, length - i);
+}
+
+void replaceSse2(char *data, size_t length, char from, char to) {
+    const __m128i match = _mm_set1_epi8(from);
+    const __m128i flip = _mm_set1_epi8(from ^ to);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)(data + i));
+        __m128i hit = _mm_cmpeq_epi8(x, match);
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(x, _mm_and_si128(hit, flip)));
+    }
+    replaceScalar(data + i, length - i, from, to);
+}
+
+void upperReplaceSse2(char *data, size_t length, char from, char to) {
+    const __m128i shift = _mm_set1_epi8((char)(128 - 'a'));
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i match = _mm_set1_epi8(from);
+    const __m128i flip = _mm_set1_epi8(from ^ to);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)(data + i));
+        __m128i lower = _mm_cmplt_epi8(_mm_add_epi8(x, shift), limit);
+        x = _mm_xor_si128(x, _mm_and_si128(lower, caseBit));
+        __m128i hit = _mm_cmpeq_epi8(x, match);
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(x, _mm_and_si128(hit, flip)));
+    }
+    upperReplaceScalar(data + i, length - i, from, to);
+}
+
+__attribute__((target("avx2")))
+void upperAvx2(char *data, size_t length) {
+    const __m256i shift = _mm256_set1_epi8((char)(128 - 'a'));
+    const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)(data + i));
+        __m256i lower = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(x, shift));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(x, _mm256_and_si256(lower, caseBit)));
+    }
+    upperScalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void replaceAvx2(char *data, size_t length, char from, char to) {
+    const __m256i match = _mm256_set1_epi8(from);
+    const __m256i flip = _mm256_set1_epi8(from ^ to);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)(data + i));
+        __m256i hit = _mm256_cmpeq_epi8(x, match);
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(x, _mm256_and_si256(hit, flip)));
+    }
+    replaceScalar(data + i, length - i, from, to);
+}
+
+__attribute__((target("avx2")))
+void upperReplaceAvx2(char *data, size_t length, char from, char to) {
+    const __m256i shift = _mm256_set1_epi8((char)(128 - 'a'));
+    const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i match = _mm256_set1_epi8(from);
+    const __m256i flip = _mm256_set1_epi8(from ^ to);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)(data + i));
+        __m256i lower = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(x, shift));
+        x = _mm256_xor_si256(x, _mm256_and_si256(lower, caseBit));
+        __m256i hit = _mm256_cmpeq_epi8(x, match);
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(x, _mm256_and_si256(hit, flip)));
     }
+    upperReplaceScalar(data + i, length - i, from, to);
+}
+#endif
+
+// Every kernel set, the slowest first
+Kernels kernelSets[] = {
+    { "scalar", upperScalar, replaceScalar, upperReplaceScalar },
+#ifdef HAVE_X86_KERNELS
+    { "sse2", upperSse2, replaceSse2, upperReplaceSse2 },
+    { "avx2", upperAvx2, replaceAvx2, upperReplaceAvx2 },
+#endif
+};
 
-    int lineIndex = currentReadIndex;
-    currentReadIndex++; // Next line
+// Whether this CPU can run a kernel set
+int kernelsSupported(Kernels *set) {
+#ifdef HAVE_X86_KERNELS
+    if (strcmp(set->name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)set;
+    return 1;
+}
 
-    for (int i = 0; i <= lineIndex; i++) {
-        if (fgets(lines[lineIndex], MAX_LINE_LENGTH, file) == NULL) {
-            fclose(file);
-            pthread_mutex_unlock(&read_mutex);
-            pthread_exit(NULL); // Exit when there is no more lines
+// Use the last set the CPU supports
+void selectKernels() {
+    kernels = &kernelSets[0];
+    for (size_t i = 0; i < sizeof(kernelSets) / sizeof(kernelSets[0]); i++) {
+        if (kernelsSupported(&kernelSets[i])) {
+            kernels = &kernelSets[i];
         }
     }
+}
 
-    // Remove newline character and check for empty lines
-    lines[lineIndex][strcspn(lines[lineIndex], "\n")] = '\0';
-    if (strlen(lines[lineIndex]) == 0) {
-        fclose(file);
-        pthread_mutex_unlock(&read_mutex);
-        pthread_exit(NULL); // Exit for empty line
+// Microbenchmark, --bench-kernels: every kernel of every supported set over
+// BENCH_BUFFER_SIZE bytes of text, on one core. Prints GB/s, best of 5.
+void benchKernels() {
+    char *text = malloc(BENCH_BUFFER_SIZE);
+    char *buffer = malloc(BENCH_BUFFER_SIZE);
+    const char *words = "The quick brown Fox jumps over the lazy dog, 0123456789\n";
+    size_t wordsLength = strlen(words);
+    for (size_t i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        text[i] = words[i % wordsLength];
     }
 
-    totalLines++; // Total number of lines incremented.
-    fclose(file);
-    // Printf to make table view
-    printf("Read_%d                          Read_%d Read the line %d which is \"%s\"\n", lineIndex + 1, lineIndex + 1, lineIndex + 1, lines[lineIndex]);
-    pthread_mutex_unlock(&read_mutex);
-    pthread_exit(NULL); // Exit from thread
+    printf("%-8s %-14s %8s\n", "kernels", "kernel", "GB/s");
+    for (size_t k = 0; k < sizeof(kernelSets) / sizeof(kernelSets[0]); k++) {
+        Kernels *set = &kernelSets[k];
+        if (!kernelsSupported(set)) {
+            continue;
+        }
+        for (int kernel = 0; kernel < 3; kernel++) {
+            double best = 0;
+            for (int run = 0; run < 5; run++) {
+                memcpy(buffer, text, BENCH_BUFFER_SIZE); // same input every run
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (kernel == 0) {
+                    set->upper(buffer, BENCH_BUFFER_SIZE);
+                } else if (kernel == 1) {
+                    set->replace(buffer, BENCH_BUFFER_SIZE, ' ', '_');
+                } else {
+                    set->upperReplace(buffer, BENCH_BUFFER_SIZE, ' ', '_');
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                double rate = BENCH_BUFFER_SIZE / seconds / 1e9;
+                if (rate > best) {
+                    best = rate;
+                }
+            }
+            const char *names[] = { "upper", "replace", "upper+replace" };
+            printf("%-8s %-14s %8.2f\n", set->name, names[kernel], best);
+        }
+    }
+    free(text);
+    free(buffer);
 }
 
-// Function to convert a line to uppercase
-void *upperThreads(void *arg) {
-    int *lineIndex = (int *)arg;
+// Transform chain, -t. Byte maps (upper, lower, replace, tr) are 256-entry
+// tables; consecutive ones are composed into one table, so any number of
+// them costs one pass. The upper stage runs the maps before the first line
+// step, with a vector kernel when the table is one of the common chains.
+// The line steps (trim, filter and the maps after them) run one line at a
+// time in the replace stage, all of them in one pass over the chunk.
 
-    pthread_mutex_lock(&process_mutex); // Lock mutex
+void identityTable(unsigned char *table) {
+    for (int x = 0; x < 256; x++) {
+        table[x] = x;
+    }
+}
 
-    // Create a copy of the original line
-    char mainLine[MAX_LINE_LENGTH];
-    strcpy(mainLine, lines[*lineIndex]);
+// Whether table is base followed by replacing one byte. from and to are that
+// byte and what it becomes, equal when table is base itself.
+int mapMatches(const unsigned char *base, const unsigned char *table, char *from, char *to) {
+    int found = 0;
+    *from = *to = 0;
+    for (int x = 0; x < 256 && !found; x++) {
+        if (table[x] != base[x]) {
+            *from = base[x];
+            *to = table[x];
+            found = 1;
+        }
+    }
+    for (int x = 0; x < 256; x++) {
+        unsigned char expected = base[x] == (unsigned char)*from && found ? (unsigned char)*to : base[x];
+        if (table[x] != expected) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Map every byte through a table, for tables no vector kernel does
+void tableScalar(char *data, size_t length, const unsigned char *table) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = table[(unsigned char)data[i]];
+    }
+}
+
+// The upper stage's table over a span, with the fastest kernel that gives the same bytes
+void mapText(char *text, size_t length) {
+    switch (mapKernel) {
+        case MAP_UPPER:
+            kernels->upper(text, length);
+            break;
+        case MAP_REPLACE:
+            kernels->replace(text, length, mapFrom, mapTo);
+            break;
+        case MAP_UPPER_REPLACE:
+            kernels->upperReplace(text, length, mapFrom, mapTo);
+            break;
+        case MAP_TABLE:
+            tableScalar(text, length, mapTable);
+            break;
+    }
+}
 
-    // Convert the line to uppercase, if it is a letter between a and z.
-    for (int i = 0; lines[*lineIndex][i] != '\0'; i++) {
-        if (lines[*lineIndex][i] >= 'a' && lines[*lineIndex][i] <= 'z') {
-            lines[*lineIndex][i] -= 32;
+int lineContains(const char *line, size_t length, const char *pattern, size_t patternLength) {
+    const char *p = line;
+    while ((size_t)(line + length - p) >= patternLength) {
+        if (patternLength == 0) {
+            return 1;
+        }
+        p = memchr(p, pattern[0], line + length - p - patternLength + 1);
+        if (p == NULL) {
+            return 0;
         }
+        if (memcmp(p, pattern, patternLength) == 0) {
+            return 1;
+        }
+        p++;
     }
+    return 0;
+}
 
-    // Printf to make table view
-    printf("Upper_%d                         Upper_%d read index %d and converted \"%s\" to \"%s\"\n", 
-        *lineIndex + 1, *lineIndex + 1, *lineIndex + 1, mainLine, lines[*lineIndex]);
+// Run steps on one line, without its newline. The line may start later and
+// get shorter (trim); returns 0 when a filter drops it.
+int runSteps(LineStep *steps, int count, char **line, size_t *length) {
+    for (int s = 0; s < count; s++) {
+        LineStep *step = &steps[s];
+        if (step->kind == TRANSFORM_MAP) {
+            tableScalar(*line, *length, step->table);
+        } else if (step->kind == TRANSFORM_TRIM) {
+            while (*length > 0 && ((*line)[0] == ' ' || (*line)[0] == '\t' || (*line)[0] == '\r')) {
+                (*line)++;
+                (*length)--;
+            }
+            while (*length > 0 && ((*line)[*length - 1] == ' ' || (*line)[*length - 1] == '\t' || (*line)[*length - 1] == '\r')) {
+                (*length)--;
+            }
+        } else if (!lineContains(*line, *length, step->pattern, step->patternLength)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    pthread_mutex_unlock(&process_mutex); // Unlock the mutex
-    pthread_exit(NULL); // Exit from thread
+// The line steps over whole lines of text, moving the kept lines down over
+// the dropped and trimmed bytes in the same pass. Returns the new length;
+// newline is set when the last line had no newline and was kept.
+size_t lineStepsText(char *text, size_t length, int *newline) {
+    size_t kept = 0;
+    *newline = 0;
+    for (size_t start = 0; start < length; ) {
+        char *end = memchr(text + start, '\n', length - start);
+        size_t lineEnd = end != NULL ? (size_t)(end - text) : length;
+        char *line = text + start;
+        size_t lineLength = lineEnd - start;
+        if (runSteps(lineSteps, lineStepCount, &line, &lineLength)) {
+            memmove(text + kept, line, lineLength);
+            kept += lineLength;
+            if (end != NULL) {
+                text[kept++] = '\n';
+            } else {
+                *newline = 1;
+            }
+        }
+        start = lineEnd + 1;
+    }
+    return kept;
 }
 
-// Function to replace spaces with underscores
-void *replaceThreads(void *arg) {
-    int *lineIndex = (int *)arg;
+// Parse -t: steps separated by commas, out of upper, lower, replace:X=Y,
+// tr:SET=SET (a shorter second set repeats its last byte, like tr), trim and
+// filter:TEXT (keeps the lines that contain TEXT). Every step is kept in
+// chainSteps for the trace table, then the maps are composed. Returns -1
+// for a bad chain.
+int parseChain(const char *chain) {
+    const char *p = chain;
+    while (*p != '\0') {
+        if (chainStepCount == MAX_CHAIN_STEPS) {
+            fprintf(stderr, "Error: at most %d transform steps.\n", MAX_CHAIN_STEPS);
+            return -1;
+        }
+        LineStep *step = &chainSteps[chainStepCount++];
+        step->kind = TRANSFORM_MAP;
+        identityTable(step->table);
+        const char *end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+        size_t length = end - p;
 
-    pthread_mutex_lock(&process_mutex); // Lock mutex
+        if (length == 5 && strncmp(p, "upper", 5) == 0) {
+            for (int x = 'a'; x <= 'z'; x++) {
+                step->table[x] = x - 32;
+            }
+        } else if (length == 5 && strncmp(p, "lower", 5) == 0) {
+            for (int x = 'A'; x <= 'Z'; x++) {
+                step->table[x] = x + 32;
+            }
+        } else if (strncmp(p, "replace:", 8) == 0 && strlen(p) >= 11 && p[9] == '=' &&
+                (p[11] == ',' || p[11] == '\0')) {
+            step->table[(unsigned char)p[8]] = p[10]; // X and Y may be commas themselves
+            end = p + 11;
+        } else if (strncmp(p, "tr:", 3) == 0 && memchr(p + 3, '=', length - 3) != NULL) {
+            const char *from = p + 3;
+            const char *to = memchr(from, '=', end - from) + 1;
+            size_t fromLength = to - 1 - from;
+            size_t toLength = end - to;
+            if (toLength == 0) {
+                fprintf(stderr, "Error: tr needs bytes to map to.\n");
+                return -1;
+            }
+            for (size_t i = 0; i < fromLength; i++) {
+                step->table[(unsigned char)from[i]] = to[i < toLength ? i : toLength - 1];
+            }
+        } else if (length == 4 && strncmp(p, "trim", 4) == 0) {
+            step->kind = TRANSFORM_TRIM;
+        } else if (strncmp(p, "filter:", 7) == 0 && length > 7) {
+            step->kind = TRANSFORM_FILTER;
+            step->pattern = p + 7;
+            step->patternLength = length - 7;
+        } else {
+            fprintf(stderr, "Error: unknown transform %.*s\n", (int)length, p);
+            return -1;
+        }
+        if (step->kind == TRANSFORM_MAP && step->table['\n'] != '\n') {
+            fprintf(stderr, "Error: a transform may not change newlines.\n");
+            return -1;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
 
-    // Create a copy of the original line
-    char mainLine[MAX_LINE_LENGTH];
-    strcpy(mainLine, lines[*lineIndex]);
+    // Compose: maps up to the first line step make mapTable, later runs of
+    // maps make one map line step each
+    unsigned char table[256];
+    identityTable(table);
+    int composed = 0; // maps in table
+    int upperDone = 0; // mapTable is set, later maps are line steps
+    for (int s = 0; s <= chainStepCount; s++) {
+        LineStep *step = s < chainStepCount ? &chainSteps[s] : NULL;
+        if (step != NULL && step->kind == TRANSFORM_MAP) {
+            for (int x = 0; x < 256; x++) {
+                table[x] = step->table[table[x]];
+            }
+            composed++;
+            continue;
+        }
+        if (!upperDone) {
+            memcpy(mapTable, table, sizeof(mapTable));
+            upperDone = 1;
+        } else if (composed > 0) {
+            lineSteps[lineStepCount].kind = TRANSFORM_MAP;
+            memcpy(lineSteps[lineStepCount++].table, table, sizeof(table));
+        }
+        if (step != NULL) {
+            lineSteps[lineStepCount++] = *step;
+        }
+        identityTable(table);
+        composed = 0;
+    }
+
+    // The fastest kernel that does mapTable
+    unsigned char identity[256], upper[256];
+    identityTable(identity);
+    identityTable(upper);
+    for (int x = 'a'; x <= 'z'; x++) {
+        upper[x] = x - 32;
+    }
+    if (mapMatches(identity, mapTable, &mapFrom, &mapTo)) {
+        mapKernel = mapFrom == mapTo ? MAP_NONE : MAP_REPLACE;
+    } else if (mapMatches(upper, mapTable, &mapFrom, &mapTo)) {
+        mapKernel = mapFrom == mapTo ? MAP_UPPER : MAP_UPPER_REPLACE;
+    } else {
+        mapKernel = MAP_TABLE;
+    }
+    return 0;
+}
 
-    // Replace spaces with underscores
-    for (int i = 0; lines[*lineIndex][i] != '\0'; i++) {
-        if (lines[*lineIndex][i] == ' ') {
-            lines[*lineIndex][i] = '_';
+// Lines first up to last of a chunk
+void chunkLines(size_t chunk, size_t *first, size_t *last) {
+    if (streaming) {
+        Window *window = &windows[chunk % STREAM_WINDOWS];
+        *first = window->firstLine;
+        *last = window->firstLine + window->lineCount;
+        return;
+    }
+    *first = chunk * CHUNK_LINES;
+    *last = *first + CHUNK_LINES < totalLines ? *first + CHUNK_LINES : totalLines;
+}
+
+// Text of a chunk's lines, newlines included
+char *chunkSpan(size_t first, size_t last, size_t *length) {
+    size_t end = lineOffsets[last] < inputSize ? lineOffsets[last] : inputSize;
+    *length = end - lineOffsets[first];
+    return input + lineOffsets[first];
+}
+
+// Text of a chunk, newlines included: its lines in the mapped input, or its
+// window when streaming
+char *chunkText(size_t chunk, size_t *length) {
+    if (streaming) {
+        Window *window = &windows[chunk % STREAM_WINDOWS];
+        *length = window->length;
+        return window->data;
+    }
+    size_t first, last;
+    chunkLines(chunk, &first, &last);
+    return chunkSpan(first, last, length);
+}
+
+void queueInit(ChunkQueue *queue) {
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+// Add a chunk, waiting while the queue is full
+void queuePush(ChunkQueue *queue, size_t chunk) {
+    size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (1) {
+        QueueCell *cell = &queue->cells[position & (QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)(sequence - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                cell->chunk = chunk;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return;
+            }
+        } else {
+            if (difference < 0) {
+                sched_yield(); // full, wait for a consumer
+            }
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
         }
     }
+}
 
-    // Printf to make table view
-    printf("Replace_%d                       Replace_%d read index %d and replaced spaces in \"%s\" to \"%s\"\n", 
-        *lineIndex + 1, *lineIndex + 1, *lineIndex + 1, mainLine, lines[*lineIndex]);
+// Take a chunk, returns 0 when the queue is empty
+int queueTryPop(ChunkQueue *queue, size_t *chunk) {
+    size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (1) {
+        QueueCell *cell = &queue->cells[position & (QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)(sequence - (position + 1));
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *chunk = cell->chunk;
+                atomic_store_explicit(&cell->sequence, position + QUEUE_CAPACITY, memory_order_release);
+                return 1;
+            }
+        } else if (difference < 0) {
+            return 0;
+        } else {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
 
-    pthread_mutex_unlock(&process_mutex); // Unlock the mutex
-    pthread_exit(NULL); // Exit from the thread
+// Owner only: add a task at the bottom
+void dequePush(WorkDeque *deque, int64_t task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(&deque->tasks[bottom & (QUEUE_CAPACITY - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
 }
 
-// Function to write processed lines to the output file
-void *writeThreads(void *arg) {
+// Owner only: take the newest task, returns 0 when there is none
+int dequePop(WorkDeque *deque, int64_t *task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return 0;
+    }
+    *task = atomic_load_explicit(&deque->tasks[bottom & (QUEUE_CAPACITY - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // The last task, a thief may be taking it at the same time
+        int won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
 
-    // Output is written to output.txt
-    FILE *file = fopen("output.txt", "w");
-    if (file == NULL) {
-        perror("Error opening output file");
-        pthread_mutex_unlock(&process_mutex); // Before exit ensure to unlock mutex
-        pthread_exit(NULL);
+// Any worker: take the oldest task, returns 0 when there is none or another
+// thread got it first
+int dequeSteal(WorkDeque *deque, int64_t *task) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return 0;
+    }
+    *task = atomic_load_explicit(&deque->tasks[top & (QUEUE_CAPACITY - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Map the input file and index its lines in one pass. memchr() checks a
+// whole vector of bytes per step in glibc, so every byte is looked at once
+// instead of every line being read again from the start of the file.
+int loadInput(const char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0) {
+        close(fd);
+        return -1;
+    }
+    inputSize = fileStat.st_size;
+    if (inputSize > 0) {
+        input = mmap(NULL, inputSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (input == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(input, inputSize, MADV_WILLNEED);
+    }
+    close(fd);
+
+    size_t capacity = inputSize / 64 + 2; // a guess, grown below when lines are shorter
+    lineOffsets = malloc(capacity * sizeof(size_t));
+    if (lineOffsets == NULL) {
+        return -1;
+    }
+    size_t offset = 0;
+    while (offset < inputSize) {
+        if (totalLines + 2 > capacity) {
+            capacity *= 2;
+            size_t *grown = realloc(lineOffsets, capacity * sizeof(size_t));
+            if (grown == NULL) {
+                free(lineOffsets);
+                lineOffsets = NULL;
+                return -1;
+            }
+            lineOffsets = grown;
+        }
+        lineOffsets[totalLines++] = offset;
+        char *newline = memchr(input + offset, '\n', inputSize - offset);
+        // The last line may have no newline, it ends one byte earlier then
+        offset = newline != NULL ? (size_t)(newline - input) + 1 : inputSize + 1;
+    }
+    lineOffsets[totalLines] = offset;
+    totalChunks = (totalLines + CHUNK_LINES - 1) / CHUNK_LINES;
+    return 0;
+}
+
+// Read stage: fault the chunk's pages in, one load per page, so the
+// transforms find them in memory
+void readChunk(size_t chunk) {
+    size_t length;
+    volatile char *text = chunkText(chunk, &length);
+    for (size_t i = 0; i < length; i += 4096) {
+        (void)text[i];
+    }
+}
+
+// Upper stage: the chain's maps, uppercase and spaces to underscores by
+// default, in one pass over the chunk, a whole vector of bytes at a time
+void upperChunk(size_t chunk) {
+    size_t length;
+    char *text = chunkText(chunk, &length);
+    mapText(text, length);
+}
+
+// Replace stage: the chain's line steps, nothing for the default chain. The
+// chunk's lines move down in place, in a file it is placed after that.
+void replaceChunk(size_t chunk) {
+    if (lineStepCount == 0) {
+        return;
+    }
+    size_t length;
+    char *text = chunkText(chunk, &length);
+    int newline;
+    length = lineStepsText(text, length, &newline);
+    if (streaming) {
+        windows[chunk % STREAM_WINDOWS].length = length; // the reader gave every line a newline
+    } else {
+        chunkOutputs[chunk].length = length;
+        chunkOutputs[chunk].newline = newline;
+    }
+}
+
+// Write stage: without line steps every line keeps its length and gets one
+// newline, so the output offset of a line, the prefix sum of the output
+// lengths before it, is its input offset. With them placeChunks() worked it
+// out. A chunk is one pwritev() at its own place in the file whatever order
+// chunks finish in, and writers never wait for each other.
+void writeChunk(size_t chunk) {
+    size_t first, last, length;
+    chunkLines(chunk, &first, &last);
+    char *text = chunkSpan(first, last, &length);
+    int newline = lineOffsets[last] > inputSize; // the last line had no newline
+    off_t offset = lineOffsets[first];
+    if (chunkOutputs != NULL) {
+        length = chunkOutputs[chunk].length;
+        newline = chunkOutputs[chunk].newline;
+        offset = chunkOutputs[chunk].offset;
+    }
+
+    struct iovec parts[2] = { { text, length }, { "\n", 1 } };
+    struct iovec *part = parts;
+    int partCount = newline ? 2 : 1;
+    while (partCount > 0) {
+        ssize_t written = pwritev(outputFd, part, partCount, offset);
+        if (written < 0) {
+            perror("Error writing output file");
+            exit(EXIT_FAILURE);
+        }
+        offset += written;
+        // A short write goes on from where it stopped
+        while (partCount > 0 && (size_t)written >= part->iov_len) {
+            written -= part->iov_len;
+            part++;
+            partCount--;
+        }
+        if (partCount > 0) {
+            part->iov_base = (char *)part->iov_base + written;
+            part->iov_len -= written;
+        }
+    }
+}
+
+uint64_t traceClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - runStart.tv_sec) * 1000000000 + now.tv_nsec - runStart.tv_nsec;
+}
+
+// Record a finished stage in the worker's ring. A full ring waits for the
+// drainer rather than losing the event.
+void traceRecord(Worker *worker, int stage, size_t chunk, uint64_t start) {
+    TraceRing *ring = worker->trace;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+        sched_yield();
+    }
+    size_t first, last;
+    chunkLines(chunk, &first, &last);
+    TraceEvent *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    event->start = start;
+    event->end = traceClock();
+    event->firstLine = first;
+    event->lineCount = last - first;
+    event->worker = worker->number;
+    event->stage = stage;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void printStreamEvent(TraceEvent *event);
+
+// Move every event the workers recorded so far into traceEvents. A stream
+// may never end, so its events are printed here instead of kept.
+void drainTraceRings() {
+    for (int i = 0; i < workerCount + stageThreadCount; i++) {
+        TraceRing *ring = workers[i].trace;
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            if (streaming) {
+                printStreamEvent(&ring->events[tail & (TRACE_RING_SIZE - 1)]);
+                continue;
+            }
+            if (traceEventCount == traceEventCapacity) {
+                traceEventCapacity = traceEventCapacity == 0 ? 4096 : traceEventCapacity * 2;
+                traceEvents = realloc(traceEvents, traceEventCapacity * sizeof(TraceEvent));
+                if (traceEvents == NULL) {
+                    perror("Error collecting trace");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            traceEvents[traceEventCount++] = ring->events[tail & (TRACE_RING_SIZE - 1)];
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+}
+
+// Function run by the trace drainer thread until the pool is done
+void *traceDrainerThread(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, TRACE_DRAIN_INTERVAL };
+    while (!atomic_load(&traceStop)) {
+        drainTraceRings();
+        nanosleep(&interval, NULL);
+    }
+    drainTraceRings();
+    pthread_exit(NULL);
+}
+
+int compareTraceEvents(const void *a, const void *b) {
+    const TraceEvent *x = a;
+    const TraceEvent *y = b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->stage - y->stage;
+}
+
+// The table the program always printed, one row per line and stage in the
+// order the stages ran. Events only hold line numbers, the texts are made
+// again from a fresh mapping of the unchanged input file: the upper rows show
+// the chain's first step, the replace rows the rest of it.
+void printTraceTable() {
+    int fd = open(fileName, O_RDONLY);
+    char *original = inputSize > 0 && fd >= 0 ? mmap(NULL, inputSize, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (original == MAP_FAILED) {
+        original = NULL;
+    }
+    char *upper = NULL; // a line after the chain's first step
+    char *final = NULL; // and after all of it
+    size_t bufferSize = 0;
+    int firstSteps = chainStepCount > 0 ? 1 : 0;
+
+    printf("<Thread-type and ID>            <Output>\n");
+    for (size_t e = 0; e < traceEventCount && original != NULL; e++) {
+        TraceEvent *event = &traceEvents[e];
+        int id = event->worker + 1;
+        for (size_t i = event->firstLine; i < event->firstLine + event->lineCount; i++) {
+            int length = (int)lineLength(i);
+            char *before = original + lineOffsets[i];
+            if ((size_t)length + 1 > bufferSize) {
+                bufferSize = length + 1;
+                upper = realloc(upper, bufferSize);
+                final = realloc(final, bufferSize);
+            }
+            // A line a filter drops is shown empty from there on and not written
+            memcpy(upper, before, length);
+            char *upperText = upper;
+            size_t upperLength = length;
+            int kept = runSteps(chainSteps, firstSteps, &upperText, &upperLength);
+            upperLength = kept ? upperLength : 0;
+            memcpy(final, upperText, upperLength);
+            char *finalText = final;
+            size_t finalLength = upperLength;
+            kept = kept && runSteps(chainSteps + firstSteps, chainStepCount - firstSteps, &finalText, &finalLength);
+            finalLength = kept ? finalLength : 0;
+
+            // Printf to make table view
+            switch (event->stage) {
+                case STAGE_READ:
+                    printf("Read_%-27dRead_%d Read the line %zu which is \"%.*s\"\n", id, id, i + 1, length, before);
+                    break;
+                case STAGE_UPPER:
+                    printf("Upper_%-26dUpper_%d read index %zu and converted \"%.*s\" to \"%.*s\"\n",
+                        id, id, i + 1, length, before, (int)upperLength, upperText);
+                    break;
+                case STAGE_REPLACE:
+                    printf("Replace_%-24dReplace_%d read index %zu and replaced spaces in \"%.*s\" to \"%.*s\"\n",
+                        id, id, i + 1, (int)upperLength, upperText, (int)finalLength, finalText);
+                    break;
+                case STAGE_WRITE:
+                    if (kept) {
+                        printf("Write_%-26dWrite_%d write line %zu back which is \"%.*s\"\n",
+                            id, id, i + 1, (int)finalLength, finalText);
+                    }
+                    break;
+            }
+        }
+    }
+    free(upper);
+    free(final);
+    if (original != NULL) {
+        munmap(original, inputSize);
+    }
+}
+
+// The JSON trace: the run's shape, every event with lines counted from 1
+// like in the table, then what the whole run took and cost. It is printed
+// in three parts so a stream can print its events as they are drained.
+void printTraceJsonStart() {
+    fprintf(traceFile, "{\n  \"workers\": %d,\n  \"replace_steps\": %d,\n", workerCount, lineStepCount);
+    if (batch) {
+        fprintf(traceFile, "  \"files\": %zu,\n  \"io\": \"%s\",\n", batchCount,
+            atomic_load(&uringThreads) > 0 ? "io_uring" : "pread");
+    } else if (streaming) {
+        fprintf(traceFile, "  \"window_bytes\": %d,\n", STREAM_WINDOW_SIZE);
+    } else {
+        fprintf(traceFile, "  \"chunk_lines\": %d,\n", CHUNK_LINES);
+    }
+    fprintf(traceFile, "  \"events\": [");
+}
+
+void printTraceEventJson(TraceEvent *event) {
+    fprintf(traceFile, "%s\n    {\"stage\": \"%s\", \"worker\": %d, \"first_line\": %llu, \"lines\": %u, "
+        "\"start_ns\": %llu, \"end_ns\": %llu}", tracePrinted++ > 0 ? "," : "", stageNames[event->stage],
+        event->worker + 1, (unsigned long long)event->firstLine + 1, event->lineCount,
+        (unsigned long long)event->start, (unsigned long long)event->end);
+}
+
+void printTraceJsonEnd(uint64_t wallTime) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(traceFile, "\n  ],\n  \"input_bytes\": %zu,\n  \"lines\": %zu,\n  \"wall_ns\": %llu,\n"
+        "  \"max_rss_kb\": %ld,\n  \"voluntary_context_switches\": %ld,\n  \"involuntary_context_switches\": %ld\n}\n",
+        inputSize, totalLines, (unsigned long long)wallTime, usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+}
+
+// A streamed event, in the order the drainer finds it. The texts are gone by
+// then, so a table row names the lines instead of showing them.
+void printStreamEvent(TraceEvent *event) {
+    if (traceMode == TRACE_JSON) {
+        printTraceEventJson(event);
+        return;
+    }
+    const char *verbs[STAGE_COUNT] = { "Read", "converted", "replaced spaces in", "write" };
+    const char *types[STAGE_COUNT] = { "Read", "Upper", "Replace", "Write" };
+    int id = event->worker + 1;
+    int width = 31 - (int)strlen(types[event->stage]);
+    fprintf(traceFile, "%s_%-*d%s_%d %s lines %llu to %llu\n", types[event->stage], width, id,
+        types[event->stage], id, verbs[event->stage], (unsigned long long)event->firstLine + 1,
+        (unsigned long long)(event->firstLine + event->lineCount));
+}
+
+void wakeIdleWorkers() {
+    if (atomic_load(&idleWorkers) > 0) {
+        pthread_mutex_lock(&idle_mutex);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+}
+
+// Give every chunk whose line steps are done and all chunks before it too
+// its output offset, and queue its write on this worker. Called once a chunk
+// is done with the replace stage, in any order.
+void placeChunks(Worker *worker, size_t chunk) {
+    int placed = 0;
+    pthread_mutex_lock(&place_mutex);
+    chunkOutputs[chunk].ready = 1;
+    while (placedChunks < totalChunks && chunkOutputs[placedChunks].ready) {
+        ChunkOutput *output = &chunkOutputs[placedChunks];
+        output->offset = placedBytes;
+        placedBytes += output->length + output->newline;
+        dequePush(&worker->deque, (int64_t)placedChunks * STAGE_COUNT + STAGE_WRITE);
+        placedChunks++;
+        placed++;
+    }
+    pthread_mutex_unlock(&place_mutex);
+    if (placed > 1) {
+        wakeIdleWorkers();
+    }
+}
+
+// Start up to CLAIM_CHUNKS new chunks while fewer than QUEUE_CAPACITY are in
+// flight, that bound is the backpressure. The first is returned as a read
+// task, the others wait in the deque where idle workers can steal them.
+int startChunks(Worker *worker, int64_t *task) {
+    size_t inFlight = atomic_load(&chunksInFlight);
+    size_t count;
+    do {
+        if (inFlight >= QUEUE_CAPACITY) {
+            return 0;
+        }
+        count = QUEUE_CAPACITY - inFlight < CLAIM_CHUNKS ? QUEUE_CAPACITY - inFlight : CLAIM_CHUNKS;
+    } while (!atomic_compare_exchange_weak(&chunksInFlight, &inFlight, inFlight + count));
+
+    size_t chunk = atomic_fetch_add(&currentReadChunk, count);
+    size_t started = chunk >= totalChunks ? 0 : (totalChunks - chunk < count ? totalChunks - chunk : count);
+    if (started < count) {
+        atomic_fetch_sub(&chunksInFlight, count - started);
+    }
+    if (started == 0) {
+        return 0;
+    }
+    // Pushed newest last, so the owner goes on with chunk and thieves take chunk + 1 first
+    for (size_t i = started - 1; i > 0; i--) {
+        dequePush(&worker->deque, (int64_t)(chunk + i) * STAGE_COUNT + STAGE_READ);
+    }
+    if (started > 1) {
+        wakeIdleWorkers();
+    }
+    *task = (int64_t)chunk * STAGE_COUNT + STAGE_READ;
+    return 1;
+}
+
+// Next task for a worker: its own newest, a parked one whose stage has room,
+// a new chunk, or the oldest task of another worker. A stream's chunks are
+// started by its reader.
+int findTask(Worker *worker, int64_t *task) {
+    size_t chunk;
+    if (dequePop(&worker->deque, task)) {
+        return 1;
+    }
+    for (int stage = STAGE_COUNT - 1; stage >= 0; stage--) {
+        if (atomic_load(&stageActive[stage]) < stageLimits[stage] && queueTryPop(&parkedTasks[stage], &chunk)) {
+            *task = (int64_t)chunk * STAGE_COUNT + stage;
+            return 1;
+        }
     }
+    if (!streaming && startChunks(worker, task)) {
+        return 1;
+    }
+    int start = rand_r(&worker->seed) % workerCount;
+    for (int i = 0; i < workerCount; i++) {
+        Worker *victim = &workers[(start + i) % workerCount];
+        if (victim != worker && dequeSteal(&victim->deque, task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run one stage on one chunk and queue the chunk's next stage for this worker
+void runTask(Worker *worker, int64_t task) {
+    int stage = task % STAGE_COUNT;
+    size_t chunk = task / STAGE_COUNT;
 
-    // Write all changed lines
-    for (int i = 0; i < totalLines; i++) {
-        // Printf to make table view
-        fprintf(file, "%s\n", lines[i]);
-        printf("Write_%d                         Write_%d write line %d back which is \"%s\"\n", i + 1, i + 1,  i + 1, lines[i]);
+    if (atomic_fetch_add(&stageActive[stage], 1) >= stageLimits[stage]) {
+        // The stage has all the workers it may have, somebody takes it later
+        atomic_fetch_sub(&stageActive[stage], 1);
+        queuePush(&parkedTasks[stage], chunk);
+        return;
+    }
+    uint64_t start = worker->trace != NULL ? traceClock() : 0;
+    switch (stage) {
+        case STAGE_READ:
+            readChunk(chunk);
+            break;
+        case STAGE_UPPER:
+            upperChunk(chunk);
+            break;
+        case STAGE_REPLACE:
+            replaceChunk(chunk);
+            break;
+        case STAGE_WRITE:
+            writeChunk(chunk);
+            break;
     }
+    if (worker->trace != NULL) {
+        traceRecord(worker, stage, chunk, start);
+    }
+    atomic_fetch_sub(&stageActive[stage], 1);
+
+    if (streaming && stage == STAGE_REPLACE) {
+        sem_post(&windows[chunk % STREAM_WINDOWS].transformed); // the writer keeps the order
+    } else if (chunkOutputs != NULL && stage == STAGE_REPLACE) {
+        placeChunks(worker, chunk);
+    } else if (stage < STAGE_WRITE) {
+        dequePush(&worker->deque, task + 1);
+    } else {
+        atomic_fetch_sub(&chunksInFlight, 1);
+        atomic_fetch_add(&chunksFinished, 1);
+        wakeIdleWorkers(); // room for a new chunk, or the end
+    }
+}
+
+// Function run by every pool thread until all chunks are written
+void *workerThreads(void *arg) {
+    Worker *worker = arg;
+    int64_t task;
+    int misses = 0;
 
-    fclose(file); // Closing file, it is done
-    pthread_mutex_unlock(&process_mutex); // Unlock mutex after closed file
+    while (atomic_load(&chunksFinished) < totalChunks) {
+        if (findTask(worker, &task)) {
+            runTask(worker, task);
+            misses = 0;
+        } else if (++misses < IDLE_SPINS) {
+            sched_yield();
+        } else {
+            // Sleep until a chunk is done; a short timeout covers a wakeup missed
+            // between the last look and the wait
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 1000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            atomic_fetch_add(&idleWorkers, 1);
+            pthread_mutex_lock(&idle_mutex);
+            if (atomic_load(&chunksFinished) < totalChunks) {
+                pthread_cond_timedwait(&idle_cond, &idle_mutex, &until);
+            }
+            pthread_mutex_unlock(&idle_mutex);
+            atomic_fetch_sub(&idleWorkers, 1);
+            misses = 0;
+        }
+    }
     pthread_exit(NULL); // Exit from the thread
 }
 
-int main(int argc, char *argv[]) {
-    
-    if (argc < 6 || strcmp(argv[1], "-d") != 0 || strcmp(argv[3], "-n") != 0) {
-        fprintf(stderr, "Usage: %s -d <file_name> -n <read_threads> <upper_threads> <replace_threads> <write_threads>\n", argv[0]);
+// Make room for at least size bytes in a window, for a line longer than it
+void growWindow(Window *window, size_t size) {
+    if (size <= window->capacity) {
+        return;
+    }
+    while (window->capacity < size) {
+        window->capacity *= 2;
+    }
+    window->data = realloc(window->data, window->capacity);
+    if (window->data == NULL) {
+        perror("Error growing stream window");
         exit(EXIT_FAILURE);
     }
+}
 
-    // Read arguments
-    const char *fileName = argv[2];
-    int readThreadsNumber = atoi(argv[4]);
-    int upperThreadsNumber = atoi(argv[5]);
-    int replaceThreadsNumber = atoi(argv[6]);
-    int writeThreadsNumber = atoi(argv[7]);
+// Streaming read stage, run by the main thread: fill windows from inputFd
+// and hand each one to the pool once it holds whole lines. A window ends
+// early when the next read would block, so a slow pipe gets its lines through
+// at once while a fast one fills whole windows. The unfinished last line moves
+// to the next window; a free window is waited for, that is the backpressure.
+void streamInput(Worker *reader) {
+    size_t chunk = 0;
+    sem_wait(&freeWindows);
+    Window *window = &windows[0];
+    size_t used = 0; // bytes in the window, the unfinished line included
+    int end = 0;
 
-    // Initialize mutexes
-    pthread_mutex_init(&read_mutex, NULL);
-    pthread_mutex_init(&process_mutex, NULL);
+    while (!end) {
+        uint64_t start = reader->trace != NULL ? traceClock() : 0;
+        size_t lineEnd = 0; // bytes of whole lines
+        size_t lines = 0;
+        struct pollfd ready = { inputFd, POLLIN, 0 };
+        do {
+            growWindow(window, used + 1);
+            ssize_t count = read(inputFd, window->data + used, window->capacity - used);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Error reading input");
+                exit(EXIT_FAILURE);
+            }
+            if (count == 0) {
+                end = 1;
+                break;
+            }
+            inputSize += count;
+            char *newline = memchr(window->data + used, '\n', count);
+            used += count;
+            for (; newline != NULL; newline = memchr(newline + 1, '\n', window->data + used - newline - 1)) {
+                lineEnd = newline - window->data + 1;
+                lines++;
+            }
+        } while (lineEnd == 0 || (used < window->capacity && poll(&ready, 1, 0) > 0));
 
-    // Initialize thread arrays
-    pthread_t read_threads[readThreadsNumber];
-    pthread_t upper_threads[upperThreadsNumber];
-    pthread_t replace_threads[replaceThreadsNumber];
-    pthread_t write_threads[writeThreadsNumber];
+        if (end && used > lineEnd) {
+            // The last line had no newline, it gets one like in the file mode
+            growWindow(window, used + 1);
+            window->data[used++] = '\n';
+            lineEnd = used;
+            lines++;
+        }
+        if (lineEnd == 0) {
+            break;
+        }
+        sem_wait(&freeWindows);
+        Window *next = &windows[(chunk + 1) % STREAM_WINDOWS];
+        growWindow(next, used - lineEnd);
+        memcpy(next->data, window->data + lineEnd, used - lineEnd);
 
-    // Thread index
-    int threadIndex[MAX_LINES];
+        window->length = lineEnd;
+        window->firstLine = totalLines;
+        window->lineCount = lines;
+        totalLines += lines;
+        if (reader->trace != NULL) {
+            traceRecord(reader, STAGE_READ, chunk, start);
+        }
+        queuePush(&parkedTasks[STAGE_UPPER], chunk);
+        wakeIdleWorkers();
 
-    printf("<Thread-type and ID>            <Output>\n");
+        chunk++;
+        used -= lineEnd;
+        window = next;
+    }
+    // The window after the last is held here, waking the writer on it says there is no more
+    atomic_store(&totalChunks, chunk);
+    sem_post(&window->transformed);
+    wakeIdleWorkers();
+}
+
+// Streaming write stage: put the windows out in input order, each as soon as
+// the pool is done with it, and give it back to the reader
+void *streamWriterThread(void *arg) {
+    Worker *writer = arg;
+    for (size_t chunk = 0; ; chunk++) {
+        Window *window = &windows[chunk % STREAM_WINDOWS];
+        sem_wait(&window->transformed);
+        if (chunk >= atomic_load(&totalChunks)) {
+            break;
+        }
+        uint64_t start = writer->trace != NULL ? traceClock() : 0;
+        for (size_t done = 0; done < window->length; ) {
+            ssize_t written = write(outputFd, window->data + done, window->length - done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Error writing output");
+                exit(EXIT_FAILURE);
+            }
+            done += written;
+        }
+        if (writer->trace != NULL) {
+            traceRecord(writer, STAGE_WRITE, chunk, start);
+        }
+        sem_post(&freeWindows);
+        atomic_fetch_add(&chunksFinished, 1);
+        wakeIdleWorkers(); // the end, once the last window is out
+    }
+    pthread_exit(NULL);
+}
+
+// Batch inputs from a directory (its regular files), an @list (a path per
+// line) or a glob pattern
+int collectBatchInputs(const char *source) {
+    size_t capacity = 0;
+    if (source[0] == '@') {
+        FILE *list = fopen(source + 1, "r");
+        if (list == NULL) {
+            return -1;
+        }
+        char *line = NULL;
+        size_t lineSize = 0;
+        ssize_t length;
+        while ((length = getline(&line, &lineSize, list)) >= 0) {
+            if (length > 0 && line[length - 1] == '\n') {
+                line[--length] = '\0';
+            }
+            if (length == 0) {
+                continue;
+            }
+            if (batchCount == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                batchInputs = realloc(batchInputs, capacity * sizeof(char *));
+            }
+            batchInputs[batchCount++] = strdup(line);
+        }
+        free(line);
+        fclose(list);
+        return 0;
+    }
+
+    DIR *directory = opendir(source);
+    if (directory != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != NULL) {
+            size_t pathSize = strlen(source) + strlen(entry->d_name) + 2;
+            char *path = malloc(pathSize);
+            snprintf(path, pathSize, "%s/%s", source, entry->d_name);
+            struct stat pathStat;
+            int regular = entry->d_type == DT_REG ||
+                (entry->d_type == DT_UNKNOWN && stat(path, &pathStat) == 0 && S_ISREG(pathStat.st_mode));
+            if (!regular) {
+                free(path);
+                continue;
+            }
+            if (batchCount == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                batchInputs = realloc(batchInputs, capacity * sizeof(char *));
+            }
+            batchInputs[batchCount++] = path;
+        }
+        closedir(directory);
+        return 0;
+    }
+
+    glob_t matches;
+    if (glob(source, 0, NULL, &matches) != 0) {
+        return -1;
+    }
+    batchInputs = malloc(matches.gl_pathc * sizeof(char *));
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        batchInputs[batchCount++] = strdup(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+    return 0;
+}
+
+// File name of a batch input, which it keeps in the output directory
+const char *batchInputName(const char *inputPath) {
+    const char *slash = strrchr(inputPath, '/');
+    return slash != NULL ? slash + 1 : inputPath;
+}
+
+// Output path of a batch input: its name in the output directory
+char *batchOutputPath(const char *inputPath) {
+    const char *name = batchInputName(inputPath);
+    size_t pathSize = strlen(batchOutputDir) + strlen(name) + 2;
+    char *path = malloc(pathSize);
+    snprintf(path, pathSize, "%s/%s", batchOutputDir, name);
+    return path;
+}
+
+int compareBatchNames(const void *a, const void *b) {
+    return strcmp(batchInputName(*(char *const *)a), batchInputName(*(char *const *)b));
+}
+
+int compareFileIds(const void *a, const void *b) {
+    const struct stat *x = a, *y = b;
+    if (x->st_dev != y->st_dev) return x->st_dev < y->st_dev ? -1 : 1;
+    if (x->st_ino != y->st_ino) return x->st_ino < y->st_ino ? -1 : 1;
+    return 0;
+}
+
+// The output path names the input file (or what stdin is redirected from),
+// the same check as for batch outputs
+int isInputFile(const char *outputPath) {
+    struct stat inputStat, outputStat;
+    int inputFound = strcmp(fileName, "-") == 0 ? fstat(STDIN_FILENO, &inputStat) == 0 : stat(fileName, &inputStat) == 0;
+    return inputFound && stat(outputPath, &outputStat) == 0 && compareFileIds(&inputStat, &outputStat) == 0;
+}
 
-    // Create read threads
-    for (int i = 0; i < readThreadsNumber; i++) {
-        threadIndex[i] = i;
-        if (pthread_create(&read_threads[i], NULL, readThreads, &threadIndex[i]) != 0) {
-            perror("Error creating read thread");
+// Refuse a batch that would destroy its own data before anything runs: two
+// inputs with the same name would be written to one output file, and an
+// output that already is an input (-o naming the input directory, or a link
+// to an input) would be truncated before it is read.
+void checkBatchOutputs() {
+    char **names = malloc(batchCount * sizeof(char *));
+    memcpy(names, batchInputs, batchCount * sizeof(char *));
+    qsort(names, batchCount, sizeof(char *), compareBatchNames);
+    for (size_t i = 1; i < batchCount; i++) {
+        if (compareBatchNames(&names[i - 1], &names[i]) == 0) {
+            fprintf(stderr, "Error: %s and %s would both be written to %s/%s\n",
+                names[i - 1], names[i], batchOutputDir, batchInputName(names[i]));
             exit(EXIT_FAILURE);
         }
     }
+    free(names);
 
-    // Wait for threads to finish
-    for (int i = 0; i < readThreadsNumber; i++) {
-        pthread_join(read_threads[i], NULL);
+    // Inputs that cannot be stat()ed fail later on their own
+    struct stat *inputIds = malloc(batchCount * sizeof(struct stat));
+    size_t idCount = 0;
+    for (size_t i = 0; i < batchCount; i++) {
+        if (stat(batchInputs[i], &inputIds[idCount]) == 0) {
+            idCount++;
+        }
+    }
+    qsort(inputIds, idCount, sizeof(struct stat), compareFileIds);
+    for (size_t i = 0; i < batchCount; i++) {
+        char *outputPath = batchOutputPath(batchInputs[i]);
+        struct stat outputStat;
+        if (stat(outputPath, &outputStat) == 0 &&
+            bsearch(&outputStat, inputIds, idCount, sizeof(struct stat), compareFileIds) != NULL) {
+            fprintf(stderr, "Error: output %s is one of the inputs, choose another -o directory\n", outputPath);
+            exit(EXIT_FAILURE);
+        }
+        free(outputPath);
+    }
+    free(inputIds);
+}
+
+// The transform chain over a whole file's text, which has room for one more
+// byte: a last line without a newline gets one like in the file
+// mode. Returns the new size.
+size_t batchTransform(char *data, size_t size) {
+    atomic_fetch_add(&batchBytes, size);
+    if (size > 0 && data[size - 1] != '\n') {
+        data[size++] = '\n';
+    }
+    mapText(data, size);
+    if (lineStepCount > 0) {
+        int newline;
+        size = lineStepsText(data, size, &newline);
+    }
+
+    size_t lines = 0;
+    for (char *newline = memchr(data, '\n', size); newline != NULL;
+            newline = memchr(newline + 1, '\n', data + size - newline - 1)) {
+        lines++;
+    }
+    atomic_fetch_add(&batchLines, lines);
+    return size;
+}
+
+void batchFailed(size_t input, const char *what, int error) {
+    fprintf(stderr, "Error %s %s: %s\n", what, batchInputs[input], strerror(error));
+    atomic_fetch_add(&batchFailures, 1);
+}
+
+// One batch file with blocking calls, for when there is no io_uring
+void batchFileSync(size_t input) {
+    int fd = open(batchInputs[input], O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) < 0) {
+        batchFailed(input, "reading", errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    char *data = malloc(fileStat.st_size + 1);
+    size_t size = 0;
+    while (size < (size_t)fileStat.st_size) {
+        ssize_t count = pread(fd, data + size, fileStat.st_size - size, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break; // an error below, or a file that shrank ends where its data does
+        }
+        size += count;
+    }
+    int error = size < (size_t)fileStat.st_size ? errno : 0;
+    close(fd);
+    if (error != 0) {
+        batchFailed(input, "reading", error);
+        free(data);
+        return;
     }
+    size = batchTransform(data, size);
 
-    // Create upper threads
-    for (int i = 0; i < upperThreadsNumber; i++) {
-        threadIndex[i] = i;
-        if (pthread_create(&upper_threads[i], NULL, upperThreads, &threadIndex[i]) != 0) {
-            perror("Error creating upper thread");
+    char *outputPath = batchOutputPath(batchInputs[input]);
+    fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(outputPath);
+    size_t done = 0;
+    while (fd >= 0 && done < size) {
+        ssize_t written = pwrite(fd, data + done, size - done, done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            break;
+        }
+        done += written;
+    }
+    if (done < size || fd < 0) {
+        batchFailed(input, "writing", errno);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(data);
+}
+
+#ifdef HAVE_IO_URING
+// Set up a ring, returns -1 when the kernel has none or too old a one (the
+// open, statx and close operations came with IORING_FEAT_RW_CUR_POS, 5.6)
+int uringInit(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return -1;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    char *base = ring->rings;
+    ring->sqTail = (unsigned *)(base + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(base + params.sq_off.array);
+    ring->cqHead = (unsigned *)(base + params.cq_off.head);
+    ring->cqTail = (unsigned *)(base + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    ring->toSubmit = 0;
+    return 0;
+}
+
+void uringFree(Uring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->rings, ring->ringsSize);
+    close(ring->fd);
+}
+
+// Next submission entry, cleared; it goes to the kernel with the next uringEnter()
+struct io_uring_sqe *uringEntry(Uring *ring, int opcode, int fd, size_t slot, int op) {
+    unsigned index = (*ring->sqTail + ring->toSubmit++) & *ring->sqMask;
+    struct io_uring_sqe *entry = &ring->sqes[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->opcode = opcode;
+    entry->fd = fd;
+    entry->user_data = slot * 8 + op;
+    ring->sqArray[index] = index;
+    return entry;
+}
+
+// Submit what was filled and wait for at least one completion
+void uringEnter(Uring *ring) {
+    __atomic_store_n(ring->sqTail, *ring->sqTail + ring->toSubmit, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Error waiting for io_uring");
             exit(EXIT_FAILURE);
         }
     }
+    ring->toSubmit = 0;
+}
+
+void batchSubmitRead(Uring *ring, BatchFile *file, size_t slot) {
+    struct io_uring_sqe *entry = uringEntry(ring, IORING_OP_READ, file->inputFd, slot, BATCH_OP_READ);
+    entry->addr = (uintptr_t)(file->data + file->done);
+    entry->len = file->size - file->done;
+    entry->off = file->done;
+    file->waiting++;
+}
+
+void batchSubmitWrite(Uring *ring, BatchFile *file, size_t slot) {
+    struct io_uring_sqe *entry = uringEntry(ring, IORING_OP_WRITE, file->outputFd, slot, BATCH_OP_WRITE);
+    entry->addr = (uintptr_t)(file->data + file->done);
+    entry->len = file->size - file->done;
+    entry->off = file->done;
+    file->waiting++;
+}
+
+void batchSubmitClose(Uring *ring, int *fd, size_t slot) {
+    uringEntry(ring, IORING_OP_CLOSE, *fd, slot, BATCH_OP_CLOSE);
+    *fd = -1;
+}
+
+// Start a file in a free slot: open both ends and ask for the input's size at once
+void batchStart(Uring *ring, BatchFile *file, size_t slot, size_t input) {
+    memset(file, 0, sizeof(*file));
+    file->input = input;
+    file->outputPath = batchOutputPath(batchInputs[input]); // read by the kernel until the open is done
+    file->inputFd = -1;
+    file->outputFd = -1;
+    file->phase = BATCH_OPEN;
+    file->waiting = 3;
 
-    // Create replace threads
-    for (int i = 0; i < replaceThreadsNumber; i++) {
-        threadIndex[i] = i;
-        if (pthread_create(&replace_threads[i], NULL, replaceThreads, &threadIndex[i]) != 0) {
-            perror("Error creating replace thread");
+    struct io_uring_sqe *entry = uringEntry(ring, IORING_OP_OPENAT, AT_FDCWD, slot, BATCH_OP_OPEN_INPUT);
+    entry->addr = (uintptr_t)batchInputs[input];
+    entry->open_flags = O_RDONLY;
+    entry = uringEntry(ring, IORING_OP_STATX, AT_FDCWD, slot, BATCH_OP_STATX);
+    entry->addr = (uintptr_t)batchInputs[input];
+    entry->len = STATX_SIZE;
+    entry->off = (uintptr_t)&file->stat;
+    entry = uringEntry(ring, IORING_OP_OPENAT, AT_FDCWD, slot, BATCH_OP_OPEN_OUTPUT);
+    entry->addr = (uintptr_t)file->outputPath;
+    entry->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    entry->len = 0644;
+}
+
+void batchFinish(BatchFile *file) {
+    free(file->data);
+    free(file->outputPath);
+}
+
+// Handle a completion of a slot's file, and start its next phase once every
+// operation of this one is back. Returns 1 when the file is done.
+int batchComplete(Uring *ring, BatchFile *file, size_t slot, int op, int result) {
+    file->waiting--;
+    if (result < 0 && op != BATCH_OP_CLOSE) {
+        if (!file->failed) {
+            batchFailed(file->input, op == BATCH_OP_OPEN_OUTPUT || op == BATCH_OP_WRITE ? "writing" : "reading", -result);
+        }
+        file->failed = 1;
+    } else if (op == BATCH_OP_OPEN_INPUT) {
+        file->inputFd = result;
+    } else if (op == BATCH_OP_OPEN_OUTPUT) {
+        file->outputFd = result;
+    } else if (op == BATCH_OP_STATX) {
+        file->size = file->stat.stx_size;
+    } else if (op == BATCH_OP_READ) {
+        file->done += result;
+        if (result > 0 && file->done < file->size) {
+            batchSubmitRead(ring, file, slot); // a short read goes on from where it stopped
+            return 0;
+        }
+        file->size = file->done; // a file that shrank ends where its data does
+    } else if (op == BATCH_OP_WRITE) {
+        file->done += result;
+        if (result > 0 && file->done < file->size) {
+            batchSubmitWrite(ring, file, slot);
+            return 0;
+        }
+    }
+    if (file->waiting > 0) {
+        return 0;
+    }
+
+    if (file->failed && file->phase != BATCH_CLOSE) {
+        // Close what was opened and drop the file
+        if (file->inputFd >= 0) {
+            batchSubmitClose(ring, &file->inputFd, slot);
+            file->waiting++;
+        }
+        if (file->outputFd >= 0) {
+            batchSubmitClose(ring, &file->outputFd, slot);
+            file->waiting++;
+            unlink(file->outputPath); // opened with the input, no half output is left
+        }
+        file->phase = BATCH_CLOSE;
+        if (file->waiting > 0) {
+            return 0;
+        }
+        batchFinish(file);
+        return 1;
+    }
+    switch (file->phase) {
+        case BATCH_OPEN:
+            file->data = malloc(file->size + 1);
+            file->phase = BATCH_READ;
+            if (file->size > 0) {
+                batchSubmitRead(ring, file, slot);
+                return 0;
+            }
+            // An empty file has nothing to read
+            // fall through
+        case BATCH_READ:
+            batchSubmitClose(ring, &file->inputFd, slot);
+            file->waiting++;
+            file->size = batchTransform(file->data, file->size);
+            file->done = 0;
+            file->phase = BATCH_WRITE;
+            if (file->size > 0) {
+                batchSubmitWrite(ring, file, slot);
+            }
+            return 0;
+        case BATCH_WRITE:
+            batchSubmitClose(ring, &file->outputFd, slot);
+            file->waiting++;
+            file->phase = BATCH_CLOSE;
+            return 0;
+        default:
+            batchFinish(file);
+            return 1;
+    }
+}
+
+// A batch thread with a ring: BATCH_DEPTH files in flight, each moving on
+// as its completions come back. Returns -1 without a ring.
+int batchUring() {
+    Uring ring;
+    if (uringInit(&ring, BATCH_RING_ENTRIES) < 0) {
+        return -1;
+    }
+    atomic_fetch_add(&uringThreads, 1);
+    BatchFile *files = malloc(BATCH_DEPTH * sizeof(BatchFile));
+    size_t freeSlots[BATCH_DEPTH];
+    size_t freeCount = BATCH_DEPTH;
+    for (size_t i = 0; i < BATCH_DEPTH; i++) {
+        freeSlots[i] = BATCH_DEPTH - 1 - i;
+    }
+
+    while (1) {
+        while (freeCount > 0) {
+            size_t input = atomic_fetch_add(&nextBatchInput, 1);
+            if (input >= batchCount) {
+                break;
+            }
+            size_t slot = freeSlots[--freeCount];
+            batchStart(&ring, &files[slot], slot, input);
+        }
+        if (freeCount == BATCH_DEPTH) {
+            break; // nothing in flight and nothing left
+        }
+        if (ring.toSubmit > 0 || __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE) == *ring.cqHead) {
+            uringEnter(&ring);
+        }
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *completion = &ring.cqes[head & *ring.cqMask];
+            size_t slot = completion->user_data / 8;
+            if (batchComplete(&ring, &files[slot], slot, completion->user_data % 8, completion->res)) {
+                freeSlots[freeCount++] = slot;
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    free(files);
+    uringFree(&ring);
+    return 0;
+}
+#endif
+
+// Function run by every batch thread until all inputs are taken
+void *batchThreads(void *arg) {
+    (void)arg;
+#ifdef HAVE_IO_URING
+    if (useUring && batchUring() == 0) {
+        pthread_exit(NULL);
+    }
+#endif
+    size_t input;
+    while ((input = atomic_fetch_add(&nextBatchInput, 1)) < batchCount) {
+        batchFileSync(input);
+    }
+    pthread_exit(NULL);
+}
+
+// Batch mode: the pool threads share the inputs, each keeps its own ring full
+// or, without io_uring, does one file at a time. Returns the exit status.
+int runBatch() {
+    if (collectBatchInputs(fileName) < 0) {
+        printf("Error: File not found or cannot be opened.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(batchOutputDir, 0755) < 0 && errno != EEXIST) {
+        perror("Error creating output directory");
+        exit(EXIT_FAILURE);
+    }
+    checkBatchOutputs();
+    pthread_t *threads = malloc(workerCount * sizeof(pthread_t));
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_create(&threads[i], NULL, batchThreads, NULL) != 0) {
+            perror("Error creating batch thread");
             exit(EXIT_FAILURE);
         }
     }
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-    // Wait for upper threads to finish
-    for (int i = 0; i < upperThreadsNumber; i++) {
-        pthread_join(upper_threads[i], NULL);
+    uint64_t wallTime = traceClock();
+    if (traceMode == TRACE_JSON) {
+        inputSize = atomic_load(&batchBytes);
+        totalLines = atomic_load(&batchLines);
+        printTraceJsonStart();
+        printTraceJsonEnd(wallTime);
+    }
+    for (size_t i = 0; i < batchCount; i++) {
+        free(batchInputs[i]);
     }
+    free(batchInputs);
+    free(threads);
+    return atomic_load(&batchFailures) > 0 ? EXIT_FAILURE : 0;
+}
 
-    // Wait for replace threads to finish
-    for (int i = 0; i < replaceThreadsNumber; i++) {
-        pthread_join(replace_threads[i], NULL);
+int main(int argc, char *argv[]) {
+
+    selectKernels();
+    if (argc == 2 && strcmp(argv[1], "--bench-kernels") == 0) {
+        benchKernels();
+        return 0;
+    }
+    
+    if (argc < 8 || strcmp(argv[1], "-d") != 0 || strcmp(argv[3], "-n") != 0) {
+        fprintf(stderr, "Usage: %s -d <file_name|-> -n <read_weight> <upper_weight> <replace_weight> <write_weight> [-j <workers>] [-o <output_file|->] [-t <transforms>] [--trace=off|table|json]\n", argv[0]);
+        fprintf(stderr, "       %s -d <directory|@list_file|'pattern'> -n ... [-j <workers>] [-o <output_directory>] [-t <transforms>] [--trace=off|json] [--no-uring]\n", argv[0]);
+        fprintf(stderr, "       transforms: comma separated upper, lower, replace:X=Y, tr:SET=SET, trim, filter:TEXT\n");
+        fprintf(stderr, "       (default upper,replace: =_). Byte maps before the first trim or filter run fused\n");
+        fprintf(stderr, "       in the upper stage; the replace stage runs the rest and is empty for the default\n");
+        fprintf(stderr, "       chain, so its weight only matters for chains with trim or filter\n");
+        fprintf(stderr, "       %s --bench-kernels\n", argv[0]);
+        exit(EXIT_FAILURE);
     }
 
-    // Create write thread
-    pthread_t write_thread;
-    if (pthread_create(&write_thread, NULL, writeThreads, NULL) != 0) {
-        perror("Error creating write thread");
+    // Read arguments. The -n numbers are stage weights: the heaviest stage may
+    // use the whole pool, the others a share in proportion.
+    fileName = argv[2];
+    int weights[STAGE_COUNT];
+    int maxWeight = 0;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        weights[stage] = atoi(argv[4 + stage]);
+        if (weights[stage] < 1) {
+            fprintf(stderr, "Error: every stage weight must be at least 1.\n");
+            exit(EXIT_FAILURE);
+        }
+        maxWeight = weights[stage] > maxWeight ? weights[stage] : maxWeight;
+    }
+    workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN); // one worker per core by default
+    int outputGiven = 0;
+    for (int i = 8; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workerCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+            outputGiven = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            transformChain = argv[++i];
+        } else if (strcmp(argv[i], "--no-uring") == 0) {
+            useUring = 0;
+        } else if (strcmp(argv[i], "--trace=off") == 0) {
+            traceMode = TRACE_OFF;
+        } else if (strcmp(argv[i], "--trace=table") == 0) {
+            traceMode = TRACE_TABLE;
+        } else if (strcmp(argv[i], "--trace=json") == 0) {
+            traceMode = TRACE_JSON;
+        } else {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (workerCount < 1) {
+        workerCount = 1;
+    }
+    if (parseChain(transformChain) < 0) {
         exit(EXIT_FAILURE);
     }
+    // A directory, an @list or a pattern that names no file is a batch
+    struct stat sourceStat;
+    int sourceFound = stat(fileName, &sourceStat) == 0;
+    batch = fileName[0] == '@' || (sourceFound && S_ISDIR(sourceStat.st_mode)) ||
+        (!sourceFound && strpbrk(fileName, "*?[") != NULL);
+    if (batch) {
+        if (traceMode == TRACE_TABLE) {
+            fprintf(stderr, "Error: a batch has no trace table, use --trace=json.\n");
+            exit(EXIT_FAILURE);
+        }
+        batchOutputDir = outputGiven ? outputName : "output";
+        traceFile = stdout;
+        clock_gettime(CLOCK_MONOTONIC, &runStart);
+        return runBatch();
+    }
+    // - is stdin or stdout; a pipe has no size and no offsets, so it is streamed
+    streaming = strcmp(fileName, "-") == 0 || strcmp(outputName, "-") == 0;
+    if (traceMode < 0) {
+        traceMode = streaming ? TRACE_OFF : TRACE_TABLE;
+    }
+    traceFile = strcmp(outputName, "-") == 0 ? stderr : stdout;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        stageLimits[stage] = (workerCount * weights[stage] + maxWeight - 1) / maxWeight;
+        queueInit(&parkedTasks[stage]);
+    }
 
-    // Wait for write threads to finish
-    pthread_join(write_thread, NULL);
+    // -o naming the input would truncate it before (or while) it is read
+    if (strcmp(outputName, "-") != 0 && isInputFile(outputName)) {
+        fprintf(stderr, "Error: output %s is the input file, choose another -o file\n", outputName);
+        exit(EXIT_FAILURE);
+    }
 
-    // Destroy mutexes end exit from the program
-    pthread_mutex_destroy(&read_mutex);
-    pthread_mutex_destroy(&process_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &runStart); // the index build counts too
+    if (streaming) {
+        inputFd = strcmp(fileName, "-") == 0 ? STDIN_FILENO : open(fileName, O_RDONLY);
+        if (inputFd < 0) {
+            printf("Error: File not found or cannot be opened.\n");
+            exit(EXIT_FAILURE);
+        }
+        outputFd = strcmp(outputName, "-") == 0 ? STDOUT_FILENO : open(outputName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0) {
+            perror("Error opening output file");
+            exit(EXIT_FAILURE);
+        }
+        atomic_store(&totalChunks, SIZE_MAX);
+        sem_init(&freeWindows, 0, STREAM_WINDOWS);
+        for (int i = 0; i < STREAM_WINDOWS; i++) {
+            windows[i].capacity = STREAM_WINDOW_SIZE;
+            windows[i].data = malloc(STREAM_WINDOW_SIZE);
+            if (windows[i].data == NULL) {
+                perror("Error allocating stream window");
+                exit(EXIT_FAILURE);
+            }
+            sem_init(&windows[i].transformed, 0, 0);
+        }
+        stageThreadCount = 2;
+    } else {
+        if (loadInput(fileName) < 0) {
+            printf("Error: File not found or cannot be opened.\n");
+            exit(EXIT_FAILURE);
+        }
+        // The output gets its final size up front, writers fill in their parts.
+        // Line steps make it shorter, it grows as the chunks are placed then.
+        outputFd = open(outputName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0 || (lineStepCount == 0 && ftruncate(outputFd, totalLines > 0 ? lineOffsets[totalLines] : 0) < 0)) {
+            perror("Error opening output file");
+            exit(EXIT_FAILURE);
+        }
+        if (lineStepCount > 0) {
+            chunkOutputs = calloc(totalChunks > 0 ? totalChunks : 1, sizeof(ChunkOutput));
+        }
+    }
+    workers = calloc(workerCount + stageThreadCount, sizeof(Worker));
+
+    pthread_t drainer;
+    if (traceMode != TRACE_OFF) {
+        for (int i = 0; i < workerCount + stageThreadCount; i++) {
+            workers[i].number = i;
+            workers[i].trace = calloc(1, sizeof(TraceRing));
+        }
+        if (streaming && traceMode == TRACE_JSON) {
+            printTraceJsonStart();
+        } else if (streaming) {
+            fprintf(traceFile, "<Thread-type and ID>            <Output>\n");
+        }
+        if (pthread_create(&drainer, NULL, traceDrainerThread, NULL) != 0) {
+            perror("Error creating trace thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A fixed pool, however long the input is
+    for (int i = 0; i < workerCount; i++) {
+        workers[i].number = i;
+        workers[i].seed = i + 1;
+        if (pthread_create(&workers[i].thread, NULL, workerThreads, &workers[i]) != 0) {
+            perror("Error creating worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A stream is read here while the writer puts it out
+    if (streaming) {
+        Worker *writer = &workers[workerCount + 1];
+        if (pthread_create(&writer->thread, NULL, streamWriterThread, writer) != 0) {
+            perror("Error creating writer thread");
+            exit(EXIT_FAILURE);
+        }
+        streamInput(&workers[workerCount]);
+        pthread_join(writer->thread, NULL);
+    }
+
+    // Wait for threads to finish
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Render the trace once the work is done, it costs the run nothing
+    uint64_t wallTime = traceClock();
+    if (traceMode != TRACE_OFF) {
+        atomic_store(&traceStop, 1);
+        pthread_join(drainer, NULL);
+        qsort(traceEvents, traceEventCount, sizeof(TraceEvent), compareTraceEvents);
+        if (traceMode == TRACE_JSON) {
+            if (!streaming) {
+                printTraceJsonStart();
+                for (size_t e = 0; e < traceEventCount; e++) {
+                    printTraceEventJson(&traceEvents[e]);
+                }
+            }
+            printTraceJsonEnd(wallTime);
+        } else if (!streaming) {
+            printTraceTable();
+        }
+        for (int i = 0; i < workerCount + stageThreadCount; i++) {
+            free(workers[i].trace);
+        }
+        free(traceEvents);
+    }
+
+    // Close the output, free the input and exit from the program
+    if (outputFd != STDOUT_FILENO) {
+        close(outputFd);
+    }
+    free(workers);
+    if (streaming) {
+        if (inputFd != STDIN_FILENO) {
+            close(inputFd);
+        }
+        for (int i = 0; i < STREAM_WINDOWS; i++) {
+            free(windows[i].data);
+            sem_destroy(&windows[i].transformed);
+        }
+        sem_destroy(&freeWindows);
+    } else {
+        free(lineOffsets);
+        free(chunkOutputs);
+        if (inputSize > 0) {
+            munmap(input, inputSize);
+        }
+    }
 
     return 0;
-}
\ No newline at end of file
+}